@@ -0,0 +1,121 @@
+/* Allocation of job slots: take the first free slot n times, then free all
+ * of them. Compares the scan of jobs array that grew by one slot at a time,
+ * bit by bit scan of a bitmap, and word-wise bit_ffc_at.
+ *
+ * Usage: bench/bitstring [number of slots] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "bitstring.h"
+
+/* Job structure is only as large as it matters for scanning. */
+typedef struct {
+  int pgid;
+  char pad[124];
+} job_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* bit_ffc as it was before it looked at whole words. */
+static int ffc_bitwise(const bitstr_t *name, int start, int nbits) {
+  for (int bit = start; bit < nbits; bit++)
+    if (!bit_test(name, bit))
+      return bit;
+  return -1;
+}
+
+static double scan_jobs(int n) {
+  double start = now();
+  job_t *jobs = calloc(1, sizeof(job_t));
+  int njobs = 1;
+
+  for (int i = 0; i < n; i++) {
+    int j;
+    for (j = 1; j < njobs; j++)
+      if (jobs[j].pgid == 0)
+        break;
+    if (j == njobs) {
+      jobs = realloc(jobs, sizeof(job_t) * ++njobs);
+      memset(&jobs[j], 0, sizeof(job_t));
+    }
+    jobs[j].pgid = 1;
+  }
+  for (int j = 1; j < njobs; j++)
+    jobs[j].pgid = 0;
+
+  free(jobs);
+  return now() - start;
+}
+
+static double scan_bits(int n) {
+  double start = now();
+  bitstr_t *used = bit_alloc(n + 1);
+
+  for (int i = 0; i < n; i++)
+    bit_set(used, ffc_bitwise(used, 1, n + 1));
+  for (int j = 1; j <= n; j++)
+    bit_clear(used, j);
+
+  free(used);
+  return now() - start;
+}
+
+static double scan_words(int n) {
+  double start = now();
+  bitstr_t *used = bit_alloc(n + 1);
+  int j;
+
+  for (int i = 0; i < n; i++) {
+    bit_ffc_at(used, 1, n + 1, &j);
+    bit_set(used, j);
+  }
+  for (j = 1; j <= n; j++)
+    bit_clear(used, j);
+
+  free(used);
+  return now() - start;
+}
+
+/* Results of word-wise scans must agree with the bit by bit scan, for any
+ * length of bitmap and any starting bit. */
+static int check(void) {
+  srand(1);
+  for (int it = 0; it < 100000; it++) {
+    int nbits = rand() % 300 + 1;
+    int start = rand() % (nbits + 1);
+    int density = rand() % 101;
+    bitstr_t *name = bit_alloc(nbits);
+    for (int i = 0; i < nbits; i++)
+      if (rand() % 100 < density)
+        bit_set(name, i);
+
+    int expected = ffc_bitwise(name, start, nbits), found;
+    bit_ffc_at(name, start, nbits, &found);
+    free(name);
+    if (found != expected) {
+      printf("bit_ffc_at(%d bits, from %d): %d, expected %d\n", nbits, start,
+             found, expected);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 100000;
+
+  if (check())
+    return EXIT_FAILURE;
+
+  printf("allocate and free %d job slots:\n", n);
+  printf("  linear job scan + realloc by one  %7.3f s\n", scan_jobs(n));
+  printf("  bit by bit bit_ffc                %7.3f s\n", scan_bits(n));
+  printf("  word-wise bit_ffc_at              %7.3f s\n", scan_words(n));
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Stress job control with many background jobs. The shell reads commands from
+# a fifo. It's given n 'sleep 1000 &' lines, lists the jobs, then all of them
+# are killed and a no-op line is sent every 10 ms until every kill has been
+# reported. At last n jobs are started again and the shell exits with all of
+# them alive, so it has to kill and wait for them.
+#
+# Usage: bench/jobs.sh [shell] [number of jobs]
+
+shell=${1:-./shell}
+n=${2:-10000}
+dir=$(mktemp -d)
+trap 'exec 3>&-; kill -9 $spid 2>/dev/null; rm -rf $dir' EXIT
+
+now() {
+  date +%s%N
+}
+
+# Print milliseconds elapsed since $1 in seconds.
+elapsed() {
+  local ms=$((($(now) - $1) / 1000000))
+  printf '%d.%03d' $((ms / 1000)) $((ms % 1000))
+}
+
+# Wait until the shell has read all lines sent so far.
+sync() {
+  echo "echo $1" >&3
+  until grep -qx "$1" $dir/out; do
+    sleep 0.01
+  done
+}
+
+spawn() {
+  yes 'sleep 1000 &' | head -n $n >&3
+  sync spawned$1
+}
+
+mkfifo $dir/in
+$shell < $dir/in > $dir/out 2> $dir/err &
+spid=$!
+exec 3> $dir/in
+
+t=$(now)
+spawn 1
+ms=$((($(now) - t) / 1000000))
+echo "spawn $n jobs: $(elapsed $t) s, $((n * 1000 / (ms + 1))) jobs/s"
+
+echo 'time jobs >/dev/null' >&3
+sync listed
+echo "'jobs' listing: $(sed -n 's/^real \([0-9.]*s\).*/\1/p' $dir/err)"
+
+t=$(now)
+sed -n 's/^\[[0-9]*\] \([0-9]*\)$/\1/p' $dir/err | xargs kill
+until [ $(grep -c "killed 'sleep" $dir/err) -ge $n ]; do
+  echo 'cd .' >&3
+  sleep 0.01
+done
+echo "reap + report all: $(elapsed $t) s"
+
+spawn 2
+t=$(now)
+exec 3>&-
+wait $spid
+echo "exit with $n live jobs: $(elapsed $t) s"
@@ -0,0 +1,129 @@
+/* Throughput of the lexer with each set of scanners: the byte-class table
+ * alone, SSE2 and AVX2 (where the processor has it). Every line is fed, scanned
+ * and tokenized as the shell does it. Best of five runs is reported.
+ *
+ * Usage: bench/lexer */
+#include "../lexer.c"
+#include <time.h>
+
+typedef struct {
+  const char *name;
+  char *(*find_delim)(char *s);
+  char *(*skip_space)(char *s);
+} scanners_t;
+
+static scanners_t scanners[] = {
+  {"table", find_delim_scalar, skip_space_scalar},
+#ifdef __x86_64__
+  {"sse2", find_delim_sse2, skip_space_sse2},
+  {"avx2", find_delim_avx2, skip_space_avx2},
+#endif
+};
+
+#define NSCANNERS (int)(sizeof(scanners) / sizeof(scanners[0]))
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool supported(scanners_t *sc) {
+#ifdef __x86_64__
+  if (sc->find_delim == find_delim_avx2) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return true;
+}
+
+/* Returns throughput in MB/s. */
+static double run(const char *line, int iters, int *ntokensp) {
+  size_t len = strlen(line);
+  double best = 1e9;
+  lexer_t lx;
+  arena_t arena;
+  char **glob;
+
+  lexer_init(&lx);
+  arena_init(&arena);
+
+  for (int r = 0; r < 5; r++) {
+    double start = now();
+    for (int i = 0; i < iters; i++) {
+      lexer_feed(&lx, line, len);
+      if (lexer_scan(&lx, true) != LEX_LINE)
+        app_error("line was not lexed");
+      tokenize(&lx, lx.line, &glob, ntokensp, &arena);
+      lexer_next(&lx);
+      arena_reset(&arena);
+    }
+    double t = now() - start;
+    if (t < best)
+      best = t;
+  }
+
+  lexer_destroy(&lx);
+  return len * iters / best / 1e6;
+}
+
+static void bench(const char *name, const char *line, int iters) {
+  int ntokens;
+
+  printf("%-26s", name);
+  for (int i = 0; i < NSCANNERS; i++) {
+    if (!supported(&scanners[i])) {
+      printf(" %8s", "-");
+      continue;
+    }
+    find_delim_vec = scanners[i].find_delim;
+    skip_space_vec = scanners[i].skip_space;
+    printf(" %8.0f", run(line, iters, &ntokens));
+    fflush(stdout);
+  }
+  printf("   (%d tokens)\n", ntokens);
+}
+
+static char *repeat(const char *s, size_t len) {
+  size_t n = strlen(s);
+  char *line = Malloc(len + 1);
+  for (size_t i = 0; i < len; i++)
+    line[i] = s[i % n];
+  line[len] = '\0';
+  return line;
+}
+
+/* 8K line of words of given length, separated by blanks. */
+static char *words(size_t len) {
+  char *line = repeat("abcdefghijklmnopqrstuvwxyz", 8192);
+  for (size_t i = len; i < 8192; i += len + 1)
+    line[i] = ' ';
+  return line;
+}
+
+int main(void) {
+  printf("%-26s", "MB/s");
+  for (int i = 0; i < NSCANNERS; i++)
+    printf(" %8s", scanners[i].name);
+  printf("\n");
+
+  bench("realistic 8K pasted line",
+        repeat("find ./src -name '*.c' -newer build/stamp | xargs grep -n "
+               "TODO > /tmp/todo.txt 2>&1 && sort -u /tmp/todo.txt | "
+               "head -n 100 ; ",
+               8192),
+        20000);
+  bench("short interactive line", "ls -l /usr/bin | grep sh > out", 2000000);
+  bench("words of 24 bytes", words(24), 20000);
+  bench("words of 48 bytes", words(48), 20000);
+  bench("words of 96 bytes", words(96), 20000);
+  bench("one 64K word", repeat("a", 65536), 500);
+
+  char *blanks = repeat(" ", 65536);
+  blanks[65535] = 'x';
+  bench("64K of blanks", blanks, 500);
+
+  bench("64K of 'a|a|a|'", repeat("a|", 65536), 200);
+  return EXIT_SUCCESS;
+}
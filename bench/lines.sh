@@ -0,0 +1,34 @@
+#!/bin/bash
+# Cost of reading and running a line in non-interactive mode: 100n lines of the
+# 'hash -r' builtin are run by the shell reading a file, so nothing but the
+# reading, lexing, parsing and running of a builtin is timed. Start-up is
+# measured with 'shell -c' run n times.
+#
+# Usage: bench/lines.sh [shell] [n]
+
+shell=${1:-./shell}
+n=${2:-2000}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+now() {
+  date +%s%N
+}
+
+# Print microseconds per run elapsed since $1 over $2 runs, to a tenth.
+per_run() {
+  local ns=$((($(now) - $1) / $2))
+  printf '%d.%d us' $((ns / 1000)) $((ns % 1000 / 100))
+}
+
+yes 'hash -r' | head -n $((n * 100)) > $dir/lines
+
+t=$(now)
+$shell $dir/lines
+echo "'shell file' per line: $(per_run $t $((n * 100)))"
+
+t=$(now)
+for ((i = 0; i < n; i++)); do
+  $shell -c 'hash -r'
+done
+echo "'shell -c' start-up:   $(per_run $t $n)"
@@ -0,0 +1,17 @@
+#!/bin/bash
+# Bulk copy through a pipeline with pipes of the default 64K capacity and of
+# 1M capacity set with PIPESIZE=. The time keyword reports wall clock time and
+# voluntary+involuntary context switches of the whole pipeline.
+#
+# Usage: bench/pipesize.sh [shell] [size copied]
+
+shell=${1:-./shell}
+size=${2:-1G}
+
+for stage in cat 'dd bs=1M status=none'; do
+  for pipesize in 64K 1M; do
+    printf '%-24s %3s pipes: ' "$stage" $pipesize
+    pipeline="head -c $size /dev/zero | $stage | $stage | wc -c >/dev/null"
+    $shell -c "time PIPESIZE=$pipesize $pipeline" 2>&1
+  done
+done
@@ -0,0 +1,66 @@
+/* Latency of starting /bin/true and waiting for it, with Fork and execve
+ * or with posix_spawn, while the launching process has a heap of given size
+ * touched, as a shell with a long history or many jobs would. Fork copies
+ * page tables of the whole heap, posix_spawn does not.
+ *
+ * Usage: bench/spawn [heap size in MiB]... */
+#include "csapp.h"
+#include <spawn.h>
+#include <time.h>
+
+#define RUNS 200
+
+static char *const argv_true[] = {"true", NULL};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static pid_t start_fork(void) {
+  pid_t pid = Fork();
+  if (pid == 0) {
+    execve("/bin/true", argv_true, environ);
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t start_spawn(void) {
+  pid_t pid;
+  int error = posix_spawn(&pid, "/bin/true", NULL, NULL, argv_true, environ);
+  if (error)
+    posix_error(error, "posix_spawn error");
+  return pid;
+}
+
+/* Returns average latency in microseconds. */
+static double run(pid_t (*start)(void)) {
+  double t = now();
+  for (int i = 0; i < RUNS; i++) {
+    int status;
+    Waitpid(start(), &status, 0);
+  }
+  return (now() - t) / RUNS * 1e6;
+}
+
+int main(int argc, char **argv) {
+  static char *defaults[] = {NULL, "16", "256", "1024", "2048"};
+
+  if (argc < 2) {
+    argv = defaults;
+    argc = sizeof(defaults) / sizeof(defaults[0]);
+  }
+
+  for (int i = 1; i < argc; i++) {
+    size_t size = (size_t)atol(argv[i]) << 20;
+    char *heap = Malloc(size);
+    memset(heap, 1, size);
+    printf("heap %5s MiB: fork+exec %6.0f us  posix_spawn %6.0f us\n", argv[i],
+           run(start_fork), run(start_spawn));
+    fflush(stdout);
+    free(heap);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+#include "shell.h"
+#include "queue.h"
+
+/* Cache of parsed command lines. Lines are looked up by their contents and
+ * the least recently used entry is reused when the cache is full. Every entry
+ * owns an arena that holds a copy of the line, its syntax tree and results of
+ * looking up commands in $PATH & expanding wildcards. */
+
+#define CACHE_SIZE 64
+#define CACHE_BUCKETS 128
+
+typedef struct centry {
+  TAILQ_ENTRY(centry) lru; /* link on list of entries in order of use */
+  struct centry *next;     /* next entry in the same bucket */
+  uint32_t hash;           /* hash of the line */
+  char *line;              /* key: line as it was read */
+  list_t *list;            /* syntax tree of the line */
+  arena_t arena;           /* memory for all of the above */
+} centry_t;
+
+static centry_t entries[CACHE_SIZE];
+static centry_t *table[CACHE_BUCKETS];
+static TAILQ_HEAD(centry_q, centry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static struct centry_q unused = TAILQ_HEAD_INITIALIZER(unused);
+
+long cache_hits = 0;
+long cache_misses = 0;
+
+static centry_t **cache_find(const char *line, uint32_t hash) {
+  centry_t **ep = &table[hash % CACHE_BUCKETS];
+  for (; *ep; ep = &(*ep)->next) {
+    if ((*ep)->hash == hash && !strcmp((*ep)->line, line)) {
+      break;
+    }
+  }
+  return ep;
+}
+
+/* Take entry out of the table and put it on list of unused ones. */
+static void cache_remove(centry_t *e) {
+  centry_t **ep = cache_find(e->line, e->hash);
+  assert(*ep == e);
+  *ep = e->next;
+  TAILQ_REMOVE(&lru, e, lru);
+  TAILQ_INSERT_HEAD(&unused, e, lru);
+  arena_reset(&e->arena);
+}
+
+/* Check that commands of the line would be looked up and expanded
+ * to the same results as remembered. */
+static bool pipeline_valid(pipeline_t *pipeline) {
+  for (int i = 0; i < pipeline->ncmd; i++) {
+    cmd_t *cmd = &pipeline->cmd[i];
+    if (!prepared_valid(cmd->exec))
+      return false;
+    for (int j = 0; j < cmd->npsub; j++) {
+      if (!pipeline_valid(cmd->psub[j].pipeline))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool cache_valid(list_t *list) {
+  for (int i = 0; i < list->nandor; i++) {
+    andor_t *andor = &list->andor[i];
+    for (int j = 0; j < andor->npipeline; j++) {
+      if (!pipeline_valid(&andor->pipeline[j]))
+        return false;
+    }
+  }
+  return true;
+}
+
+/* Return syntax tree for a line read by the lexer, from the cache if it's
+ * there and still valid. Returns NULL if the line is malformed. The tree stays
+ * valid until the next call. */
+list_t *cache_parse(lexer_t *lx) {
+  const char *line = lx->line;
+  uint32_t hash = jenkins_hash(line, strlen(line), HASHINIT);
+  centry_t *e = *cache_find(line, hash);
+
+  if (e != NULL) {
+    if (cache_valid(e->list)) {
+      cache_hits++;
+      TAILQ_REMOVE(&lru, e, lru);
+      TAILQ_INSERT_HEAD(&lru, e, lru);
+      return e->list;
+    }
+    debug("cache: '%s' is stale\n", line);
+    cache_remove(e);
+  }
+
+  cache_misses++;
+
+  if (TAILQ_EMPTY(&unused) && TAILQ_EMPTY(&lru)) {
+    for (int i = 0; i < CACHE_SIZE; i++) {
+      TAILQ_INSERT_TAIL(&unused, &entries[i], lru);
+    }
+  }
+
+  if (TAILQ_EMPTY(&unused)) {
+    cache_remove(TAILQ_LAST(&lru, centry_q));
+  }
+
+  /* Parse the line in memory of an unused entry. */
+  e = TAILQ_FIRST(&unused);
+  e->hash = hash;
+  e->line = arena_strdup(&e->arena, line);
+
+  int ntokens;
+  char **glob;
+  char *copy = arena_strdup(&e->arena, line);
+  token_t *token = tokenize(lx, copy, &glob, &ntokens, &e->arena);
+  e->list = parse(token, glob, ntokens, &e->arena);
+
+  if (e->list == NULL) {
+    arena_reset(&e->arena);
+    return NULL;
+  }
+
+  centry_t **ep = &table[hash % CACHE_BUCKETS];
+  e->next = *ep;
+  *ep = e;
+  TAILQ_REMOVE(&unused, e, lru);
+  TAILQ_INSERT_HEAD(&lru, e, lru);
+  return e->list;
+}
@@ -1,74 +1,306 @@
 #include "shell.h"
 #include <glob.h>
+#include <readline/history.h>
 
 typedef int (*func_t)(char **argv);
 
 typedef struct {
   const char *name;
   func_t func;
+  bool pure; /* only prints, so it can be run as a stage of pipeline */
 } command_t;
 
-/* expanding wildcard:
- * to expand wildcard use the linux struct glob_t */
-static void expand_wildcard(char *command, char** pattern) {
-  glob_t globbuf;
+FILE *builtin_out;
+
+/* Patterns of arguments of the running builtin, NULL for quoted words. */
+static char **builtin_glob;
+
+typedef struct {
+  const char *name;
+  int *valuep;
+  bool numeric; /* value is given as 'name=size', 0 if disabled */
+} option_t;
+
+static option_t options[] = {
+  {"spawn", &opt_spawn, false},      {"stats", &opt_stats, false},
+  {"cache", &opt_cache, false},      {"pipesize", &opt_pipesize, true},
+  {"pidfd", &opt_pidfd, false},      {NULL, NULL, false},
+};
 
-  /* find number of arguments */
+/* expanding wildcard:
+ * words with unquoted wildcards are replaced by names of matching files, other
+ * words and words that do not match any file are passed as they are.
+ * Expanded arguments are allocated from exec's arena. */
+static void expand_wildcard(exec_t *exec, char **words, char **patterns) {
   int argc = 0;
-  while (pattern[argc] != T_NULL) {
+  while (words[argc] != T_NULL) {
     argc++;
   }
 
-  /* find the number of options of command */
-  int opt = 0;
-  for (int i = 1; i < argc; ++i) {
-    if (pattern[i][0] == '-') {
-      opt++;
+  int n = 0, size = argc + 1;
+  char **argv = arena_alloc(exec->arena, sizeof(char *) * size);
+
+  for (int i = 0; i < argc; i++) {
+    if (patterns[i] == NULL) {
+      argv[n++] = words[i];
+      continue;
+    }
+
+    glob_t globbuf;
+    memset(&globbuf, 0, sizeof(glob_t));
+    glob(patterns[i], 0, NULL, &globbuf);
+    stats.glob++;
+
+    /* Only changes in current directory can be detected later on. */
+    if (index(patterns[i], '/')) {
+      exec->any_glob = true;
+    } else {
+      exec->cwd_glob = true;
+    }
+
+    if (globbuf.gl_pathc == 0) {
+      argv[n++] = words[i];
+      globfree(&globbuf);
+      continue;
+    }
+
+    if (n + globbuf.gl_pathc + (argc - i) > size) {
+      size = n + globbuf.gl_pathc + (argc - i);
+      char **larger = arena_alloc(exec->arena, sizeof(char *) * size);
+      memcpy(larger, argv, sizeof(char *) * n);
+      argv = larger;
+    }
+
+    for (size_t j = 0; j < globbuf.gl_pathc; j++) {
+      argv[n++] = arena_strdup(exec->arena, globbuf.gl_pathv[j]);
     }
+
+    globfree(&globbuf);
   }
 
-  /* reserve opt + 1 slots (for name of command and options */
-  globbuf.gl_offs = opt + 1;
+  argv[n] = NULL;
+  exec->argv = argv;
+}
 
-  /* extend first argument */
-  if (argc - opt > 1) {
-    glob(pattern[opt + 1], GLOB_DOOFFS , NULL, &globbuf);
+static bool cwd_stat(struct stat *sb) {
+  return stat(".", sb) == 0;
+}
+
+/* Look up command in $PATH and expand wildcards in its arguments, unless it
+ * was already done for this syntax tree. */
+exec_t *prepare_command(cmd_t *cmd) {
+  exec_t *exec = cmd->exec;
+  if (exec->done) {
+    return exec;
+  }
+
+  const char *name = cmd->argv[0];
+
+  if (index(name, '/')) {
+    /* Commands given with a path are not looked up in $PATH. */
+    exec->path = name;
+    exec->gen = -1;
   } else {
+    const char *path = hash_lookup(name, &exec->dir);
+    exec->path = path ? arena_strdup(exec->arena, path) : NULL;
+    exec->gen = hash_generation();
+  }
+
+  expand_wildcard(exec, cmd->argv, cmd->glob);
+
+  struct stat sb;
+  if (exec->cwd_glob && cwd_stat(&sb)) {
+    exec->cwd_dev = sb.st_dev;
+    exec->cwd_ino = sb.st_ino;
+    exec->cwd_mtime = sb.st_mtim;
+  }
+
+  exec->done = true;
+  return exec;
+}
+
+/* Check whether prepare_command would give the same results again. */
+bool prepared_valid(exec_t *exec) {
+  if (!exec->done) {
+    return true;
+  }
+
+  if (exec->any_glob) {
+    return false;
+  }
+
+  if (exec->gen >= 0 && !hash_valid(exec->gen, exec->dir)) {
+    return false;
+  }
+
+  if (exec->cwd_glob) {
+    struct stat sb;
+    if (!cwd_stat(&sb) || sb.st_dev != exec->cwd_dev ||
+        sb.st_ino != exec->cwd_ino ||
+        sb.st_mtim.tv_sec != exec->cwd_mtime.tv_sec ||
+        sb.st_mtim.tv_nsec != exec->cwd_mtime.tv_nsec) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Write a batch of output of a builtin with a single system call, unless the
+ * output is collected in memory. Errors are ignored, as for stdio. */
+static void out_writev(struct iovec *iov, int iovcnt) {
+  int fd = fileno(builtin_out);
+
+  if (fd < 0) {
+    for (int i = 0; i < iovcnt; i++)
+      fwrite(iov[i].iov_base, 1, iov[i].iov_len, builtin_out);
     return;
   }
 
-  /* extend other arguments with append option */
-  for (int i = opt + 2; i < argc; ++i) {
-    glob(pattern[i], GLOB_DOOFFS | GLOB_APPEND, NULL, &globbuf);
+  fflush(builtin_out);
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    for (; iovcnt > 0 && n >= iov->iov_len; iov++, iovcnt--)
+      n -= iov->iov_len;
+    if (iovcnt > 0) {
+      iov->iov_base += n;
+      iov->iov_len -= n;
+    }
   }
+}
 
+/* Parse 'N' (last N entries) or 'FIRST-LAST' (entries numbered from FIRST to
+ * LAST, either of which may be omitted) into range of history list indices. */
+static bool history_range(const char *arg, int *firstp, int *lastp) {
+  char *end;
+
+  if (!strchr(arg, '-')) {
+    long n = strtol(arg, &end, 10);
+    if (*end || n < 0)
+      return false;
+    if (n < *lastp - *firstp)
+      *firstp = *lastp - n;
+    return true;
+  }
 
-  /* save command and options to structure */
-  for (int i = 0; i <= opt; ++i) {
-    globbuf.gl_pathv[i] = pattern[i];
+  if (arg[0] != '-') {
+    long first = strtol(arg, &end, 10);
+    if (*end != '-')
+      return false;
+    if (first - history_base > *firstp)
+      *firstp = first - history_base;
+    arg = end;
   }
 
-  /* if there was anything to extend, do execve */
-  if (globbuf.gl_pathc > 0) {
-    execve(command, &globbuf.gl_pathv[0], environ);
+  if (arg[1] != '\0') {
+    long last = strtol(arg + 1, &end, 10);
+    if (*end)
+      return false;
+    if (last - history_base + 1 < *lastp)
+      *lastp = last - history_base + 1;
   }
+
+  return true;
 }
 
-/* do_history added to display the history of commands
- * display the content of history file */
+#define HISTORY_BATCH 256
+
+/*
+ * Display commands from history list.
+ * 'history' - display all commands
+ * 'history N' - display last N commands
+ * 'history FIRST-LAST' - display commands numbered from FIRST to LAST
+ * 'history -t ...' - display time when commands were entered as well
+ */
 static int do_history(char **argv) {
+  bool stamps = false;
+  int first = 0, last = history_length;
+
+  if (argv[0] && !strcmp(argv[0], "-t")) {
+    stamps = true;
+    argv++;
+  }
+
+  if (argv[0] && (argv[1] || !history_range(argv[0], &first, &last))) {
+    msg("history: usage: history [-t] [N | FIRST-LAST]\n");
+    return 1;
+  }
+
+  HIST_ENTRY **list = history_list();
+  struct iovec iov[HISTORY_BATCH * 3];
+  char prefix[HISTORY_BATCH][48];
+  int n = 0;
+
+  /* Each entry takes three vectors: number & time, the line and newline. */
+  for (int i = first; list && i < last; i++) {
+    char *p = prefix[n];
+    int len = sprintf(p, "%5d  ", history_base + i);
+    if (stamps) {
+      time_t t = history_get_time(list[i]);
+      if (t) {
+        len += strftime(p + len, 32, "%F %T  ", localtime(&t));
+      } else {
+        len += sprintf(p + len, "%21s", "");
+      }
+    }
+
+    iov[3 * n] = (struct iovec){.iov_base = p, .iov_len = len};
+    iov[3 * n + 1] = (struct iovec){.iov_base = list[i]->line,
+                                    .iov_len = strlen(list[i]->line)};
+    iov[3 * n + 2] = (struct iovec){.iov_base = "\n", .iov_len = 1};
 
-  if (Fork() == 0) {
-    const char *homedir = getenv("HOME");
-    char *path = strndup(homedir, strlen(homedir));
-    strapp(&path, "/.history");
-    char *argvv[] = {"cat", path, NULL};
-    external_command(argvv);
+    if (++n == HISTORY_BATCH) {
+      out_writev(iov, 3 * n);
+      n = 0;
+    }
   }
 
+  out_writev(iov, 3 * n);
   return 0;
 }
 
+/*
+ * Display or change the table of commands found in $PATH.
+ * 'hash' - display all remembered commands
+ * 'hash -r' - forget all remembered commands
+ * 'hash -p path name' - remember that name is to be found under path
+ * 'hash name ...' - find commands and remember them
+ */
+static int do_hash(char **argv) {
+  if (argv[0] == NULL) {
+    hash_list();
+    return 0;
+  }
+
+  if (!strcmp(argv[0], "-r")) {
+    hash_reset();
+    return 0;
+  }
+
+  if (!strcmp(argv[0], "-p")) {
+    if (argv[1] == NULL || argv[2] == NULL) {
+      msg("hash: usage: hash -p path name\n");
+      return 1;
+    }
+    hash_insert(argv[2], argv[1]);
+    return 0;
+  }
+
+  int rc = 0;
+  for (; *argv; argv++) {
+    if (resolve_command(*argv) == NULL) {
+      msg("hash: %s: not found\n", *argv);
+      rc = 1;
+    }
+  }
+  return rc;
+}
+
 static int do_quit(char **argv) {
   shutdownjobs();
   exit(EXIT_SUCCESS);
@@ -80,34 +312,45 @@ static int do_quit(char **argv) {
  * 'cd path' - change to provided path
  */
 static int do_chdir(char **argv) {
-  glob_t globbuf;
-  globbuf.gl_offs = 0;
   char *path = argv[0];
+  char *pattern = builtin_glob[0];
 
   if (path == NULL) {
-      path = getenv("HOME");
+    path = getenv("HOME");
+    pattern = NULL;
   }
 
-  glob(path, GLOB_DOOFFS , NULL, &globbuf);
+  glob_t globbuf;
+  memset(&globbuf, 0, sizeof(glob_t));
+  if (pattern) {
+    glob(pattern, 0, NULL, &globbuf);
+    stats.glob++;
+  }
 
   if (globbuf.gl_pathc > 1) {
     msg("cd: Wrong numbers of arguments\n");
+    globfree(&globbuf);
     return 1;
   }
 
-  int rc = chdir(globbuf.gl_pathv[0]);
-  if (rc < 0) {
+  /* Pattern that matched nothing is taken literally, as by other commands. */
+  if (globbuf.gl_pathc == 1)
+    path = globbuf.gl_pathv[0];
+
+  int rc = chdir(path);
+  if (rc < 0)
     msg("cd: %s: %s\n", strerror(errno), path);
-    return 1;
-  }
-  return 0;
+  globfree(&globbuf);
+  return rc < 0;
 }
 
 /*
  * Displays all stopped or running jobs.
+ * 'jobs -l' - display resources used by jobs and their stages as well
  */
 static int do_jobs(char **argv) {
-  watchjobs(ALL);
+  bool verbose = argv[0] && !strcmp(argv[0], "-l");
+  listjobs(verbose);
   return 0;
 }
 
@@ -119,13 +362,10 @@ static int do_jobs(char **argv) {
 static int do_fg(char **argv) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, FG, &mask)) {
+  if (!resumejob(j, FG)) {
     msg("fg: job not found: %s\n", argv[0]);
   }
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
@@ -137,13 +377,10 @@ static int do_fg(char **argv) {
 static int do_bg(char **argv) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, BG, &mask)) {
+  if (!resumejob(j, BG)) {
     msg("bg: job not found: %s\n", argv[0]);
   }
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
@@ -163,28 +400,111 @@ static int do_kill(char **argv) {
 
   int j = atoi(argv[0] + 1);
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
   if (!killjob(j)) {
     msg("kill: job not found: %s\n", argv[0]);
   }
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
-
   return 0;
 }
 
+/*
+ * Display or change shell options.
+ * 'set' - display all options
+ * 'set -o name' - enable option
+ * 'set -o name=size' - set numeric option
+ * 'set +o name' - disable option
+ */
+static int do_set(char **argv) {
+  if (argv[0] == NULL) {
+    for (option_t *opt = options; opt->name; opt++) {
+      if (opt->numeric && *opt->valuep) {
+        out("set -o %s=%d\n", opt->name, *opt->valuep);
+      } else {
+        out("set %co %s\n", *opt->valuep ? '-' : '+', opt->name);
+      }
+    }
+    return 0;
+  }
+
+  if ((strcmp(argv[0], "-o") && strcmp(argv[0], "+o")) || argv[1] == NULL) {
+    msg("set: usage: set [-o|+o name] [-o name=size]\n");
+    return 1;
+  }
+
+  bool enable = (argv[0][0] == '-');
+  size_t len = strcspn(argv[1], "=");
+  const char *value = argv[1][len] ? argv[1] + len + 1 : NULL;
+
+  for (option_t *opt = options; opt->name; opt++) {
+    if (strncmp(argv[1], opt->name, len) || opt->name[len])
+      continue;
+
+    if (!opt->numeric || !enable) {
+      if (value) {
+        msg("set: %s: option does not take a value\n", opt->name);
+        return 1;
+      }
+      *opt->valuep = enable;
+    } else if (value == NULL || !parse_size(value, opt->valuep)) {
+      msg("set: %s: invalid size\n", opt->name);
+      return 1;
+    }
+    return 0;
+  }
+
+  msg("set: %s: invalid option name\n", argv[1]);
+  return 1;
+}
+
 static command_t builtins[] = {
-  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
-  {"bg", do_bg},     {"kill", do_kill}, {"history", do_history}, {NULL, NULL},
+  {"quit", do_quit, false},      {"cd", do_chdir, false},
+  {"jobs", do_jobs, true},       {"fg", do_fg, false},
+  {"bg", do_bg, false},          {"kill", do_kill, false},
+  {"history", do_history, true}, {"set", do_set, true},
+  {"hash", do_hash, true},       {NULL, NULL, false},
 };
 
-int builtin_command(char **argv) {
+/* Commands given with a path are not looked up in $PATH. */
+const char *resolve_command(const char *name) {
+  return index(name, '/') ? name : hash_lookup(name, NULL);
+}
+
+bool builtin_p(const char *name) {
+  for (command_t *cmd = builtins; cmd->name; cmd++) {
+    if (strcmp(name, cmd->name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Builtins that do not change state of the shell can be run by the shell
+ * itself when they're a stage of pipeline. 'set' and 'hash' change the state
+ * when given arguments. */
+bool builtin_pure_p(char **argv) {
+  for (command_t *cmd = builtins; cmd->name; cmd++) {
+    if (strcmp(argv[0], cmd->name) == 0) {
+      if (cmd->func == do_set || cmd->func == do_hash)
+        return argv[1] == NULL;
+      return cmd->pure;
+    }
+  }
+
+  return false;
+}
+
+int builtin_command(cmd_t *command) {
+  char **argv = command->argv;
+
   for (command_t *cmd = builtins; cmd->name; cmd++) {
     if (strcmp(argv[0], cmd->name)) {
       continue;
     }
-    return cmd->func(&argv[1]);
+    builtin_glob = &command->glob[1];
+    int rc = cmd->func(&argv[1]);
+    fflush(builtin_out);
+    return rc;
   }
 
   errno = ENOENT;
@@ -192,28 +512,15 @@ int builtin_command(char **argv) {
 }
 
 
-noreturn void external_command(char **argv) {
-  const char *path = getenv("PATH");
-
-  if (!index(argv[0], '/') && path) {
-    /* For all paths in PATH construct an absolute path and execve it. */
-    char* command;
-    int pos;
-    while ((pos = strcspn(path, ":")) > 0) {
-      command = strndup(path, pos);
-      strapp(&command, "/");
-      strapp(&command, argv[0]);
-
-      /* try to extend command , never return if succeeded */
-      expand_wildcard(command, argv);
-      (void) execve(command, argv, environ);
-      path += (pos + 1);
-      free(command);
-    }
-  } else {
-    (void)execve(argv[0], argv, environ);
+/* Called in a subprocess with command already looked up in $PATH
+ * and its arguments expanded. */
+noreturn void external_command(const char *path, char **argv) {
+  if (path == NULL) {
+    msg("%s: command not found\n", argv[0]);
+    exit(127);
   }
 
+  (void)execve(path, argv, environ);
   msg("%s: %s\n", argv[0], strerror(errno));
-  exit(EXIT_FAILURE);
+  exit(126);
 }
@@ -0,0 +1,277 @@
+#include "shell.h"
+
+/* Table of commands resolved through $PATH. Names that were not found in any
+ * directory are remembered as well (with path set to NULL), so misspelled
+ * commands do not walk $PATH every time. */
+
+typedef struct entry {
+  struct entry *next; /* next entry in the same bucket */
+  uint32_t hash;      /* hash of command name */
+  int hits;           /* number of times the entry was used */
+  int dir;            /* index of directory in $PATH or -1 if unknown */
+  char *path;         /* absolute path or NULL if command was not found */
+  char name[];        /* command name */
+} entry_t;
+
+typedef struct {
+  char *name;             /* directory name */
+  struct timespec mtime;  /* modification time when directory was checked */
+} pathdir_t;
+
+static entry_t **table = NULL; /* array of buckets */
+static int nbuckets = 0;       /* number of buckets, power of 2 */
+static int nentries = 0;       /* number of entries in all buckets */
+
+static char *path_env = NULL;  /* copy of $PATH the table was built for */
+static pathdir_t *dirs = NULL; /* directories of $PATH */
+static int ndirs = 0;          /* number of directories */
+static bool relative = false;  /* $PATH contains directories relative to CWD */
+static int generation = 0;     /* incremented every time table is cleared */
+
+static void dir_mtime(const char *name, struct timespec *mtime) {
+  struct stat sb;
+  if (stat(name, &sb) < 0) {
+    mtime->tv_sec = mtime->tv_nsec = 0;
+  } else {
+    *mtime = sb.st_mtim;
+  }
+}
+
+/* Remove all entries, but keep the table. */
+void hash_reset(void) {
+  for (int i = 0; i < nbuckets; i++) {
+    entry_t *e, *next;
+    for (e = table[i]; e; e = next) {
+      next = e->next;
+      free(e->path);
+      free(e);
+    }
+    table[i] = NULL;
+  }
+  nentries = 0;
+  generation++;
+
+  for (int i = 0; i < ndirs; i++) {
+    dir_mtime(dirs[i].name, &dirs[i].mtime);
+  }
+}
+
+/* Split $PATH into directories. Empty entry denotes current directory. */
+static void path_update(const char *path) {
+  for (int i = 0; i < ndirs; i++) {
+    free(dirs[i].name);
+  }
+  free(dirs);
+  free(path_env);
+
+  path_env = path ? strdup(path) : NULL;
+  dirs = NULL;
+  ndirs = 0;
+  relative = false;
+
+  while (path) {
+    size_t pos = strcspn(path, ":");
+    dirs = Realloc(dirs, sizeof(pathdir_t) * (ndirs + 1));
+    dirs[ndirs].name = pos ? strndup(path, pos) : strdup(".");
+    if (dirs[ndirs].name[0] != '/') {
+      relative = true;
+    }
+    ndirs++;
+    path = path[pos] ? path + pos + 1 : NULL;
+  }
+
+  hash_reset();
+}
+
+/* Check whether $PATH or any of first n directories have changed since the
+ * table was filled. If so, the table is invalidated. */
+static void path_validate(int n) {
+  const char *path = getenv("PATH");
+
+  if ((path == NULL || path_env == NULL) ? path != path_env
+                                         : strcmp(path, path_env) != 0) {
+    path_update(path);
+    return;
+  }
+
+  for (int i = 0; i < n && i < ndirs; i++) {
+    struct timespec mtime;
+    dir_mtime(dirs[i].name, &mtime);
+    if (mtime.tv_sec != dirs[i].mtime.tv_sec ||
+        mtime.tv_nsec != dirs[i].mtime.tv_nsec) {
+      debug("hash: %s has changed\n", dirs[i].name);
+      hash_reset();
+      return;
+    }
+  }
+}
+
+static entry_t **hash_find(const char *name, uint32_t hash) {
+  if (nbuckets == 0) {
+    return NULL;
+  }
+
+  entry_t **ep = &table[hash & (nbuckets - 1)];
+  for (; *ep; ep = &(*ep)->next) {
+    if ((*ep)->hash == hash && !strcmp((*ep)->name, name)) {
+      return ep;
+    }
+  }
+
+  return ep;
+}
+
+static void hash_grow(void) {
+  int n = nbuckets ? nbuckets * 2 : 64;
+  entry_t **newtable = Calloc(n, sizeof(entry_t *));
+
+  for (int i = 0; i < nbuckets; i++) {
+    entry_t *e, *next;
+    for (e = table[i]; e; e = next) {
+      next = e->next;
+      e->next = newtable[e->hash & (n - 1)];
+      newtable[e->hash & (n - 1)] = e;
+    }
+  }
+
+  free(table);
+  table = newtable;
+  nbuckets = n;
+}
+
+static entry_t *hash_add(const char *name, uint32_t hash, const char *path,
+                         int dir) {
+  entry_t **ep = hash_find(name, hash);
+
+  if (ep && *ep) {
+    entry_t *e = *ep;
+    free(e->path);
+    e->path = path ? strdup(path) : NULL;
+    e->dir = dir;
+    return e;
+  }
+
+  if (nentries >= nbuckets) {
+    hash_grow();
+  }
+
+  size_t len = strlen(name);
+  entry_t *e = Malloc(sizeof(entry_t) + len + 1);
+  memcpy(e->name, name, len + 1);
+  e->hash = hash;
+  e->hits = 0;
+  e->dir = dir;
+  e->path = path ? strdup(path) : NULL;
+  e->next = table[hash & (nbuckets - 1)];
+  table[hash & (nbuckets - 1)] = e;
+  nentries++;
+  return e;
+}
+
+/* Walk directories of $PATH looking for an executable file. */
+static int path_search(const char *name, char **pathp) {
+  char *path = NULL;
+
+  for (int i = 0; i < ndirs; i++) {
+    path = Realloc(path, strlen(dirs[i].name) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dirs[i].name, name);
+
+    struct stat sb;
+    if (access(path, X_OK) == 0 && stat(path, &sb) == 0 &&
+        S_ISREG(sb.st_mode)) {
+      *pathp = path;
+      return i;
+    }
+  }
+
+  free(path);
+  *pathp = NULL;
+  return -1;
+}
+
+/* Find absolute path of a command, first in the table, then in $PATH.
+ * Returns NULL if command was not found. Returned string is valid only until
+ * next call to any of hash_* functions. If dirp is not NULL, index of the
+ * directory the command was found in is stored there (HASH_ANY if it was not
+ * found, HASH_UNCACHED if the result depends on current directory). */
+const char *hash_lookup(const char *name, int *dirp) {
+  uint32_t hash = jenkins_hash(name, strlen(name), HASHINIT);
+  entry_t **ep = hash_find(name, hash);
+
+  /* Command is in the table: make sure no directory it depends on changed.
+   * A file could have been removed from the directory it was found in, or
+   * added to a directory that precedes it. Negative entries depend on all
+   * directories. */
+  if (ep && *ep) {
+    entry_t *e = *ep;
+    path_validate(e->path ? e->dir + 1 : ndirs);
+    ep = hash_find(name, hash);
+  } else {
+    path_validate(0);
+  }
+
+  if (ep && *ep) {
+    (*ep)->hits++;
+    if (dirp)
+      *dirp = (*ep)->path ? (*ep)->dir : HASH_ANY;
+    return (*ep)->path;
+  }
+
+  char *path;
+  int dir = path_search(name, &path);
+
+  /* Results depending on current directory are not remembered. */
+  if (relative && (dir < 0 || dirs[dir].name[0] != '/')) {
+    static char *uncached = NULL;
+    free(uncached);
+    uncached = path;
+    if (dirp)
+      *dirp = HASH_UNCACHED;
+    return uncached;
+  }
+
+  entry_t *e = hash_add(name, hash, path, dir);
+  e->hits++;
+  free(path);
+  if (dirp)
+    *dirp = path ? dir : HASH_ANY;
+  return e->path;
+}
+
+int hash_generation(void) {
+  return generation;
+}
+
+/* Check whether result of hash_lookup obtained at given generation of the
+ * table, with directory index dir, would still be the same. */
+bool hash_valid(int gen, int dir) {
+  if (dir == HASH_UNCACHED)
+    return false;
+  path_validate(dir == HASH_ANY ? ndirs : dir + 1);
+  return gen == generation;
+}
+
+/* Remember that command name is to be found under given path. */
+void hash_insert(const char *name, const char *path) {
+  path_validate(0);
+  hash_add(name, jenkins_hash(name, strlen(name), HASHINIT), path, -1);
+}
+
+/* Display the contents of the table. */
+void hash_list(void) {
+  if (nentries == 0) {
+    msg("hash: hash table empty\n");
+    return;
+  }
+
+  out("hits\tcommand\n");
+  for (int i = 0; i < nbuckets; i++) {
+    for (entry_t *e = table[i]; e; e = e->next) {
+      if (e->path) {
+        out("%4d\t%s\n", e->hits, e->path);
+      } else {
+        out("%4d\t%s (not found)\n", e->hits, e->name);
+      }
+    }
+  }
+}
@@ -80,11 +80,29 @@ void safe_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval);
 
-/* Memory allocation wrappers */
+/* Memory allocation wrappers, heap_allocs counts calls to them */
+extern long heap_allocs;
 void *Malloc(size_t size);
 void *Realloc(void *ptr, size_t size);
 void *Calloc(size_t nmemb, size_t size);
 
+/* Arena allocator, all allocations are released at once */
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct {
+  arena_chunk_t *chunk; /* chunk that memory is allocated from */
+  char *ptr;            /* first free byte in the chunk */
+  char *end;            /* end of the chunk */
+} arena_t;
+
+void arena_init(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *s);
+void *arena_realloc(arena_t *arena, void *ptr, size_t oldsize, size_t size);
+void *arena_promote(const void *ptr, size_t size);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
 /* Process control wrappers */
 pid_t Fork(void);
 pid_t Waitpid(pid_t pid, int *iptr, int options);
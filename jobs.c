@@ -1,102 +1,578 @@
 #include "shell.h"
+#include "bitstring.h"
+#include "queue.h"
+#include <stdatomic.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 
 typedef struct proc {
-  pid_t pid;    /* process identifier */
-  int state;    /* RUNNING or STOPPED or FINISHED */
-  int exitcode; /* -1 if exit status not yet received */
+  pid_t pid;              /* process identifier or 0 for a builtin stage */
+  int pidfd;              /* process file descriptor or -1 */
+  bstage_t *stage;        /* thread writing output of a builtin stage */
+  int state;              /* RUNNING or STOPPED or FINISHED */
+  int exitcode;           /* -1 if exit status not yet received */
+  struct timespec start;  /* monotonic time the process was added to job */
+  struct timespec end;    /* monotonic time the process was reaped */
+  struct rusage rusage;   /* resources used, filled in when reaped */
+  long rchar, wchar;      /* bytes read & written, sampled before reaping */
+  int cmdpos, cmdlen;     /* position of the stage in job's command */
 } proc_t;
 
+/* Resources used by a process or a job, see 'jobs -l'. */
+typedef struct {
+  long cpu;          /* user and system time in milliseconds */
+  long maxrss;       /* peak resident set size in KiB */
+  long rchar, wchar; /* bytes read & written or -1 if not known */
+} usage_t;
+
 typedef struct job {
+  TAILQ_ENTRY(job) link; /* link on list of background jobs in same state */
   pid_t pgid;            /* 0 if slot is free */
   proc_t *proc;          /* array of processes running in as a job */
   struct termios tmodes; /* saved terminal modes */
   int nproc;             /* number of processes */
+  int maxproc;           /* number of slots in proc array */
   int state;             /* changes when live processes have same state */
+  int nrunning;          /* number of running processes */
+  int nstopped;          /* number of stopped processes */
+  int nwriting;          /* number of running builtin stages */
   char *command;         /* textual representation of command line */
+  arena_t *arena;        /* memory of proc & command, NULL if on the heap */
 } job_t;
 
 static job_t *jobs = NULL;          /* array of all jobs */
-static int njobmax = 1;             /* number of slots in jobs array */
+static int njobmax = 0;             /* number of slots in jobs array */
+static bitstr_t *jobs_used = NULL;  /* slots taken by background jobs */
 static int tty_fd = -1;             /* controlling terminal file descriptor */
 static struct termios shell_tmodes; /* saved shell terminal modes */
+static int nthreads = 0;            /* number of running builtin stages */
+static int sigchld_fd = -1;         /* signalfd for SIGCHLD if pidfds work */
 
-static proc_t* findPid(job_t job, pid_t pid) {
-  for (int i = 0; i < job.nproc; ++i) {
-    if (job.proc[i].pid == pid) {
-      return &job.proc[i];
-    }
+/* Foreground jobs are usually gone before the next line is read, so their
+ * processes and command are kept in an arena that is reset afterwards. They
+ * are promoted to the heap if a job is stopped and moved to background. */
+static arena_t fg_arena;
+
+/* Background jobs are kept on lists by state, so that watching for changes
+ * only looks at jobs that could have changed. Links are pointers into jobs
+ * array, so lists are rebuilt whenever the array is resized. */
+TAILQ_HEAD(job_q, job);
+static struct job_q job_list[3] = {
+  [FINISHED] = TAILQ_HEAD_INITIALIZER(job_list[FINISHED]),
+  [RUNNING] = TAILQ_HEAD_INITIALIZER(job_list[RUNNING]),
+  [STOPPED] = TAILQ_HEAD_INITIALIZER(job_list[STOPPED]),
+};
+
+#define bgjob_p(job) ((job) != &jobs[FG] && (job)->pgid != 0)
+
+/* Index of processes by pid: open addressing with linear probing. Entries
+ * are added when processes join a job and removed when their exit is applied
+ * to the job. Removed entries are marked as deleted rather than moved, until
+ * the index is rebuilt.
+ *
+ * Exit of a reaped child waits in the ring until it's applied, so its pid can
+ * be given to a new child in the meantime. Entries of the same pid are kept in
+ * order of insertion, so the exit is applied to the old process, and the entry
+ * of a process is told from the others by its job and index in the job. */
+typedef struct {
+  pid_t pid; /* PID_FREE, PID_DELETED or process identifier */
+  int job;   /* index of job in jobs array */
+  int proc;  /* index of process in job's proc array */
+} pident_t;
+
+#define PID_FREE 0
+#define PID_DELETED -1
+
+static pident_t *pidtab = NULL; /* array of entries, size is a power of 2 */
+static int pidcap = 0;          /* number of entries */
+static int pidused = 0;         /* number of entries not free */
+static int pidlive = 0;         /* number of entries not free nor deleted */
+
+static unsigned pid_slot(pid_t pid) {
+  return ((uint32_t)pid * 2654435761u) & (pidcap - 1);
+}
+
+/* Returns the oldest entry of pid. */
+static pident_t *pid_find(pid_t pid) {
+  if (pidcap == 0)
+    return NULL;
+
+  for (unsigned i = pid_slot(pid);; i = (i + 1) & (pidcap - 1)) {
+    if (pidtab[i].pid == pid)
+      return &pidtab[i];
+    if (pidtab[i].pid == PID_FREE)
+      return NULL;
+  }
+}
+
+static pident_t *pid_entry(pid_t pid, int job, int proc) {
+  if (pidcap == 0)
+    return NULL;
+
+  for (unsigned i = pid_slot(pid);; i = (i + 1) & (pidcap - 1)) {
+    pident_t *e = &pidtab[i];
+    if (e->pid == pid && e->job == job && e->proc == proc)
+      return e;
+    if (e->pid == PID_FREE)
+      return NULL;
+  }
+}
+
+/* Rebuild the index, so it's at most a quarter full. */
+static void pid_rehash(void) {
+  pident_t *old = pidtab;
+  int oldcap = pidcap;
+
+  for (pidcap = 64; pidcap < (pidlive + 1) * 4; pidcap *= 2)
+    continue;
+  pidtab = Calloc(pidcap, sizeof(pident_t));
+  pidused = 0;
+
+  /* Entries are moved in order of probing, which starts at a free one, so
+   * entries of the same pid stay in order even if they wrap around. */
+  int start = 0;
+  while (start < oldcap && old[start].pid != PID_FREE)
+    start++;
+
+  for (int k = 0; k < oldcap; k++) {
+    pident_t *e = &old[(start + k) & (oldcap - 1)];
+    if (e->pid == PID_FREE || e->pid == PID_DELETED)
+      continue;
+    unsigned j = pid_slot(e->pid);
+    while (pidtab[j].pid != PID_FREE)
+      j = (j + 1) & (pidcap - 1);
+    pidtab[j] = *e;
+    pidused++;
+  }
+
+  free(old);
+}
+
+static void pid_insert(pid_t pid, int job, int proc) {
+  if ((pidused + 1) * 2 > pidcap)
+    pid_rehash();
+
+  /* Take the first deleted entry after any entry of the same pid, or else
+   * the free one that ends the chain. */
+  unsigned i = pid_slot(pid), slot = pidcap;
+  for (; pidtab[i].pid != PID_FREE; i = (i + 1) & (pidcap - 1)) {
+    if (pidtab[i].pid == pid)
+      slot = pidcap;
+    else if (pidtab[i].pid == PID_DELETED && slot == pidcap)
+      slot = i;
+  }
+  if (slot == pidcap) {
+    slot = i;
+    pidused++;
+  }
+  pidtab[slot] = (pident_t){.pid = pid, .job = job, .proc = proc};
+  pidlive++;
+}
+
+/* An entry followed by a free one doesn't have to be marked as deleted, and
+ * neither do deleted entries before it. So with few processes the index is
+ * kept clean and doesn't have to be rebuilt every now and then. */
+static void pid_remove(pid_t pid, int job, int proc) {
+  pident_t *e = pid_entry(pid, job, proc);
+  if (e == NULL)
+    return;
+
+  unsigned i = e - pidtab;
+  pidlive--;
+  if (pidtab[(i + 1) & (pidcap - 1)].pid != PID_FREE) {
+    e->pid = PID_DELETED;
+    return;
   }
 
+  do {
+    pidtab[i].pid = PID_FREE;
+    pidused--;
+    i = (i - 1) & (pidcap - 1);
+  } while (pidtab[i].pid == PID_DELETED);
+}
+
+/* Builtin stages cannot be stopped. A job whose processes are all stopped is
+ * considered stopped, even if its threads are still writing. */
+static int job_state(job_t *job) {
+  if (job->nrunning > 0)
+    return RUNNING;
+  if (job->nstopped > 0)
+    return STOPPED;
+  return job->nwriting > 0 ? RUNNING : FINISHED;
+}
+
+static int *state_counter(job_t *job, proc_t *proc, int state) {
+  if (state == RUNNING)
+    return proc->stage ? &job->nwriting : &job->nrunning;
+  if (state == STOPPED)
+    return &job->nstopped;
   return NULL;
 }
 
-static int job_state(job_t job) {
-  int state = FINISHED;
-  for (int i = 0; i < job.nproc; ++i) {
-    if (job.proc[i].state == RUNNING) {
-      return RUNNING;
-    } else if (job.proc[i].state == STOPPED) {
-      state = STOPPED;
+/* Change state of a process and update state of its job. */
+static void set_state(job_t *job, proc_t *proc, int state) {
+  int *counter;
+  if ((counter = state_counter(job, proc, proc->state)))
+    (*counter)--;
+  if ((counter = state_counter(job, proc, state)))
+    (*counter)++;
+  proc->state = state;
+
+  int old = job->state;
+  job->state = job_state(job);
+  if (bgjob_p(job) && job->state != old) {
+    TAILQ_REMOVE(&job_list[old], job, link);
+    TAILQ_INSERT_TAIL(&job_list[job->state], job, link);
+  }
+}
+
+/* Finished threads raise SIGCHLD, as there is no process to be reaped for
+ * them. Mark their pseudo-processes as exited. */
+static void reapthreads(void) {
+  for (int i = 0; i < njobmax && nthreads > 0; ++i) {
+    job_t *job = &jobs[i];
+    if (job->pgid == 0)
+      continue;
+    for (int p = 0; p < job->nproc; p++) {
+      proc_t *proc = &job->proc[p];
+      if (proc->stage && proc->state == RUNNING &&
+          atomic_load_explicit(&proc->stage->done, memory_order_acquire)) {
+        clock_gettime(CLOCK_MONOTONIC, &proc->end);
+        proc->exitcode = W_EXITCODE(proc->stage->exitcode, 0);
+        set_state(job, proc, FINISHED);
+        nthreads--;
+      }
     }
   }
+}
 
-  return state;
+/* Read a file from /proc/<pid>/ into a buffer. Safe to call from a signal
+ * handler. Returns false if the file could not be read. */
+static bool read_proc(pid_t pid, const char *name, char *buf, size_t size) {
+  char path[64] = "/proc/";
+  char digits[16];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + pid % 10;
+    pid /= 10;
+  } while (pid > 0);
+
+  char *p = path + strlen(path);
+  while (n > 0)
+    *p++ = digits[--n];
+  *p++ = '/';
+  strcpy(p, name);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t len = read(fd, buf, size - 1);
+  close(fd);
+  if (len <= 0)
+    return false;
+  buf[len] = '\0';
+  return true;
 }
 
-static void sigchld_handler(int sig) {
-  int old_errno = errno;
+/* Find value of a field in "name: value" formatted /proc file. */
+static long proc_field(const char *buf, const char *name) {
+  const char *p = strstr(buf, name);
+  return p ? strtol(p + strlen(name), NULL, 10) : -1;
+}
+
+/* Sample bytes read & written by a process. Can be done until the process is
+ * reaped, so it's done for zombies just before that. Counts I/O on pipes too,
+ * not only on disks. */
+static void sample_io(pid_t pid, long *rcharp, long *wcharp) {
+  char buf[256];
+  *rcharp = *wcharp = -1;
+  if (read_proc(pid, "io", buf, sizeof(buf))) {
+    *rcharp = proc_field(buf, "rchar:");
+    *wcharp = proc_field(buf, "wchar:");
+  }
+}
+
+/* Record change of state of a process reported by wait4. */
+static void update_proc(job_t *job, proc_t *proc, int status,
+                        struct rusage *rusage, long rchar, long wchar) {
+  if (WIFEXITED(status) || WIFSIGNALED(status)) {
+    proc->exitcode = status;
+    proc->rusage = *rusage;
+    proc->rchar = rchar;
+    proc->wchar = wchar;
+    clock_gettime(CLOCK_MONOTONIC, &proc->end);
+    if (proc->pidfd >= 0) {
+      close(proc->pidfd);
+      proc->pidfd = -1;
+    }
+    pid_remove(proc->pid, job - jobs, proc - job->proc);
+    set_state(job, proc, FINISHED);
+  } else if (WIFSTOPPED(status)) {
+    proc->exitcode = status;
+    set_state(job, proc, STOPPED);
+  } else if (WIFCONTINUED(status)) {
+    proc->exitcode = status;
+    set_state(job, proc, RUNNING);
+  }
+}
+
+/* Changes of state of children, as reported by wait4, are put into a ring by
+ * SIGCHLD handler and applied to jobs by the shell itself. The handler never
+ * looks at jobs, so they can be read and modified without blocking SIGCHLD.
+ * There's a single producer (the handler, or the shell with SIGCHLD blocked)
+ * and a single consumer (the shell), so the ring needs no locks. */
+typedef struct {
   pid_t pid;
   int status;
-  /* TODO: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
-   * Bury all children that finished saving their status in jobs. */
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-    for (int i = 0; i < njobmax; ++i) {
-      if (jobs[i].pgid != 0) {
-        proc_t *proc = findPid(jobs[i], pid);
-        if (proc == NULL) continue;
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-          proc->state = FINISHED;
-          proc->exitcode = status;
-        } else if (WIFSTOPPED(status)) {
-          proc->state = STOPPED;
-          proc->exitcode = status;
-        } else if (WIFCONTINUED(status)) {
-          proc->state = RUNNING;
-          proc->exitcode = status;
-        }
-
-        jobs[i].state = job_state(jobs[i]);
-        break;
-      }
+  struct rusage rusage;
+  long rchar, wchar;
+} reaped_t;
+
+#define REAP_RING 256 /* number of records, power of 2 */
+
+static reaped_t reap_ring[REAP_RING];
+static atomic_uint reap_head = 0;           /* next record to be written */
+static atomic_uint reap_tail = 0;           /* next record to be read */
+static volatile sig_atomic_t reap_full = 0; /* children were left unreaped */
+static volatile sig_atomic_t reap_hold = 0; /* children must not be reaped */
+static volatile sig_atomic_t reap_held = 0; /* SIGCHLD came while on hold */
+
+#define CLD_EXITED_P(code)                                                     \
+  ((code) == CLD_EXITED || (code) == CLD_KILLED || (code) == CLD_DUMPED)
+
+/* Bury all children that changed state, recording their status in the ring.
+ * A child that has exited is looked at first without being reaped, so its
+ * I/O counters can still be read. If the ring fills up, remaining children
+ * are left for later. Safe to call from a signal handler. */
+static void reap_children(void) {
+  siginfo_t info;
+
+  while (true) {
+    unsigned head = atomic_load_explicit(&reap_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&reap_tail, memory_order_acquire);
+    if (head - tail == REAP_RING) {
+      reap_full = 1;
+      break;
     }
+
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info,
+               WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 ||
+        info.si_pid == 0)
+      break;
+
+    reaped_t *r = &reap_ring[head & (REAP_RING - 1)];
+    r->rchar = r->wchar = -1;
+    if (CLD_EXITED_P(info.si_code))
+      sample_io(info.si_pid, &r->rchar, &r->wchar);
+
+    r->pid = wait4(info.si_pid, &r->status, WNOHANG | WUNTRACED | WCONTINUED,
+                   &r->rusage);
+    if (r->pid <= 0)
+      continue;
+
+    atomic_store_explicit(&reap_head, head + 1, memory_order_release);
   }
+}
 
-  watchjobs(FINISHED);
+/* Only collects changes of state. They're applied to jobs and reported
+ * outside of the handler. */
+static void sigchld_handler(int sig) {
+  int old_errno = errno;
+  if (reap_hold) {
+    reap_held = 1;
+  } else {
+    reap_children();
+  }
   errno = old_errno;
 }
 
+/* While a pipeline is started, the handler must leave its processes alone.
+ * A process group exists as long as any of its members, zombies included,
+ * so other stages couldn't join the group if its leader had been reaped, nor
+ * could a foreground job be given the terminal. The hold is released by the
+ * shell once the job is created, or by monitorjob once the job is given
+ * the terminal. Cheaper than blocking SIGCHLD, as no system call is needed. */
+void holdchildren(bool hold) {
+  reap_hold = hold;
+  if (!hold && reap_held) {
+    reap_held = 0;
+    raise(SIGCHLD);
+  }
+}
+
+/* Apply changes of state collected in the ring to processes and jobs.
+ * Must be called before looking at state of jobs. */
+static void update_jobs(void) {
+  while (true) {
+    unsigned tail = atomic_load_explicit(&reap_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&reap_head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+      reaped_t *r = &reap_ring[tail & (REAP_RING - 1)];
+      pident_t *e = pid_find(r->pid);
+      if (e != NULL) {
+        job_t *job = &jobs[e->job];
+        update_proc(job, &job->proc[e->proc], r->status, &r->rusage, r->rchar,
+                    r->wchar);
+      }
+      atomic_store_explicit(&reap_tail, tail + 1, memory_order_release);
+    }
+
+    if (!reap_full)
+      break;
+
+    /* There's room in the ring again, let the handler reap the rest. If
+     * SIGCHLD is blocked, it'll be received when the shell waits next time. */
+    reap_full = 0;
+    raise(SIGCHLD);
+  }
+
+  if (nthreads > 0)
+    reapthreads();
+}
+
+/* Collect changes of state of processes, when SIGCHLD is received through
+ * a signalfd instead of the handler. Must be called with SIGCHLD blocked.
+ * Returns true if any background job has finished and should be reported. */
+bool reapjobs(void) {
+  reap_children();
+  update_jobs();
+  return !TAILQ_EMPTY(&job_list[FINISHED]);
+}
+
+/* Collect change of state of a process through its pidfd, which refers to
+ * that very process even if its pid has been reused. */
+static void wait_proc(job_t *job, proc_t *proc) {
+  siginfo_t info;
+  int status;
+  struct rusage rusage;
+
+  info.si_pid = 0;
+  if (waitid(P_PIDFD, proc->pidfd, &info,
+             WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 ||
+      info.si_pid == 0)
+    return;
+
+  long rchar = -1, wchar = -1;
+  if (CLD_EXITED_P(info.si_code))
+    sample_io(proc->pid, &rchar, &wchar);
+
+  if (wait4(proc->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &rusage) > 0)
+    update_proc(job, proc, status, &rusage, rchar, wchar);
+}
+
+/* Wait until something happens to processes of a job. Must be called with
+ * SIGCHLD blocked and changes in the ring applied. Exits are seen on pidfds
+ * of the job, stops and continues (which pidfds do not report) and changes of
+ * other jobs on signalfd.
+ *
+ * Pidfds are opened only once a job is waited for, as every open descriptor
+ * is copied into each spawned subprocess and closed again at its execve.
+ * Processes that haven't been reaped yet still own their pids. */
+static void wait_job(int j) {
+  job_t *job = &jobs[j];
+  struct pollfd *fds = alloca(sizeof(struct pollfd) * (job->nproc + 1));
+  int nfds = 0;
+
+  fds[nfds++] = (struct pollfd){.fd = sigchld_fd, .events = POLLIN};
+  for (int i = 0; i < job->nproc; i++) {
+    proc_t *proc = &job->proc[i];
+#ifdef SYS_pidfd_open
+    if (proc->pidfd < 0 && proc->pid > 0 && proc->state != FINISHED)
+      proc->pidfd = syscall(SYS_pidfd_open, proc->pid, 0);
+#endif
+    if (proc->pidfd >= 0)
+      fds[nfds++] = (struct pollfd){.fd = proc->pidfd, .events = POLLIN};
+  }
+
+  if (poll(fds, nfds, -1) < 0 && errno != EINTR)
+    unix_error("Poll error");
+
+  struct signalfd_siginfo si;
+  while (read(sigchld_fd, &si, sizeof(si)) > 0)
+    continue;
+
+  for (int i = 0; i < job->nproc; i++) {
+    if (job->proc[i].pidfd >= 0)
+      wait_proc(job, &job->proc[i]);
+  }
+
+  /* SIGCHLD was consumed, so other jobs have to be taken care of here. */
+  reapjobs();
+}
+
+/* Job monitoring based on pidfds is used if the kernel supports them. */
+static bool use_pidfd(void) {
+  return opt_pidfd && sigchld_fd >= 0;
+}
+
 /* When pipeline is done, its exitcode is fetched from the last process. */
 static int exitcode(job_t *job) {
   return job->proc[job->nproc - 1].exitcode;
 }
 
+/* Jobs array grows and shrinks by doubling or halving, never below a chunk. */
+#define JOBS_CHUNK 16
+
+static void resizejobs(int n) {
+  int oldmax = njobmax;
+  jobs = Realloc(jobs, sizeof(job_t) * n);
+  jobs_used = Realloc(jobs_used, bitstr_size(n));
+  if (n > njobmax) {
+    memset(&jobs[njobmax], 0, sizeof(job_t) * (n - njobmax));
+    /* Bits past njobmax in the last byte are never set. */
+    size_t used = bitstr_size(njobmax);
+    memset(&jobs_used[used], 0, bitstr_size(n) - used);
+  }
+  njobmax = n;
+
+  for (int i = FINISHED; i <= STOPPED; i++)
+    TAILQ_INIT(&job_list[i]);
+  for (int j = BG; j < oldmax && j < n; j++) {
+    if (jobs[j].pgid != 0)
+      TAILQ_INSERT_TAIL(&job_list[jobs[j].state], &jobs[j], link);
+  }
+}
+
+/* Give back memory when no job lives in upper three quarters of the array. */
+static void shrinkjobs(void) {
+  int j;
+  bit_ffs_at(jobs_used, njobmax / 4, njobmax, &j);
+  if (njobmax > JOBS_CHUNK && j < 0)
+    resizejobs(njobmax / 2);
+}
+
 static int allocjob(void) {
   /* Find empty slot for background job. */
-  for (int j = BG; j < njobmax; j++) {
-    if (jobs[j].pgid == 0) {
-      return j;
-    }
+  int j;
+  bit_ffc_at(jobs_used, BG, njobmax, &j);
+
+  /* If none found, allocate more. */
+  if (j < 0) {
+    j = njobmax;
+    resizejobs(njobmax * 2);
   }
 
-  /* If none found, allocate new one. */
-  jobs = realloc(jobs, sizeof(job_t) * (njobmax + 1));
-  memset(&jobs[njobmax], 0, sizeof(job_t));
-  return njobmax++;
+  bit_set(jobs_used, j);
+  return j;
+}
+
+static void *job_realloc(job_t *job, void *ptr, size_t oldsize, size_t size) {
+  if (job->arena)
+    return arena_realloc(job->arena, ptr, oldsize, size);
+  return Realloc(ptr, size);
 }
 
 static int allocproc(int j) {
   job_t *job = &jobs[j];
-  job->proc = realloc(job->proc, sizeof(proc_t) * (job->nproc + 1));
+  if (job->nproc == job->maxproc) {
+    int maxproc = job->maxproc ? job->maxproc * 2 : 4;
+    job->proc = job_realloc(job, job->proc, sizeof(proc_t) * job->maxproc,
+                            sizeof(proc_t) * maxproc);
+    job->maxproc = maxproc;
+  }
   return job->nproc++;
 }
 
@@ -109,10 +585,14 @@ int addjob(pid_t pgid, int bg) {
   job->command = NULL;
   job->proc = NULL;
   job->nproc = 0;
+  job->maxproc = 0;
+  job->nrunning = job->nstopped = job->nwriting = 0;
   job->tmodes = shell_tmodes;
+  job->arena = bg ? NULL : &fg_arena;
 
   /* Report starting process in background */
   if (bg) {
+    TAILQ_INSERT_TAIL(&job_list[RUNNING], job, link);
     msg("[%d] %d\n", j, pgid);
   }
 
@@ -121,31 +601,86 @@ int addjob(pid_t pgid, int bg) {
 
 static void deljob(job_t *job) {
   assert(job->state == FINISHED);
-  free(job->command);
-  free(job->proc);
+  if (bgjob_p(job))
+    TAILQ_REMOVE(&job_list[FINISHED], job, link);
+  for (int p = 0; p < job->nproc; p++) {
+    if (job->proc[p].pidfd >= 0)
+      close(job->proc[p].pidfd);
+    free(job->proc[p].stage);
+  }
+  if (job->arena) {
+    arena_reset(job->arena);
+  } else {
+    free(job->command);
+    free(job->proc);
+  }
+  job->arena = NULL;
   job->pgid = 0;
   job->command = NULL;
   job->proc = NULL;
   job->nproc = 0;
+  job->maxproc = 0;
+
+  if (job != &jobs[FG])
+    bit_clear(jobs_used, job - jobs);
 }
 
 static void movejob(int from, int to) {
   assert(jobs[to].pgid == 0);
+  job_t *job = &jobs[from];
+  if (job->arena) {
+    job->proc = arena_promote(job->proc, sizeof(proc_t) * job->maxproc);
+    job->command = arena_promote(job->command, strlen(job->command) + 1);
+    arena_reset(job->arena);
+    job->arena = NULL;
+  }
+  if (from != FG)
+    TAILQ_REMOVE(&job_list[jobs[from].state], &jobs[from], link);
   memcpy(&jobs[to], &jobs[from], sizeof(job_t));
   memset(&jobs[from], 0, sizeof(job_t));
+  if (from != FG)
+    bit_clear(jobs_used, from);
+  if (to != FG) {
+    bit_set(jobs_used, to);
+    TAILQ_INSERT_TAIL(&job_list[jobs[to].state], &jobs[to], link);
+  }
+
+  /* Processes that have not been reaped yet are indexed by job number. */
+  for (int i = 0; i < jobs[to].nproc; i++) {
+    pident_t *e;
+    pid_t pid = jobs[to].proc[i].pid;
+    if (pid && (e = pid_entry(pid, from, i)))
+      e->job = to;
+  }
 }
 
-static void mkcommand(char **cmdp, char **argv) {
-  if (*cmdp)
-    strapp(cmdp, " | ");
+/* Append words of a stage to textual representation of job's command.
+ * Stages are separated with " | ", words with a space. The string is grown
+ * once per stage and its length is known from the previous stage. */
+static void mkcommand(job_t *job, proc_t *proc, char **argv) {
+  size_t pos = 0, len = 0;
+  if (proc != job->proc)
+    pos = proc[-1].cmdpos + proc[-1].cmdlen + 3;
+  for (char **arg = argv; *arg; arg++)
+    len += strlen(*arg) + 1;
 
-  for (strapp(cmdp, *argv++); *argv; argv++) {
-    strapp(cmdp, " ");
-    strapp(cmdp, *argv);
+  job->command = job_realloc(job, job->command, pos ? pos - 2 : 0, pos + len);
+  char *cmd = job->command + pos;
+  if (pos > 0)
+    memcpy(cmd - 3, " | ", 3);
+  for (char **arg = argv; *arg; arg++) {
+    size_t n = strlen(*arg);
+    memcpy(cmd, *arg, n);
+    cmd += n;
+    *cmd++ = ' ';
   }
+  cmd[-1] = '\0';
+
+  proc->cmdpos = pos;
+  proc->cmdlen = len - 1;
 }
 
-void addproc(int j, pid_t pid, char **argv) {
+static void newproc(int j, pid_t pid, bstage_t *stage, char **argv) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
 
@@ -153,15 +688,58 @@ void addproc(int j, pid_t pid, char **argv) {
   proc_t *proc = &job->proc[p];
   /* Initial state of a process. */
   proc->pid = pid;
-  proc->state = RUNNING;
+  proc->pidfd = -1;
+  proc->stage = stage;
+  proc->state = FINISHED;
   proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  clock_gettime(CLOCK_MONOTONIC, &proc->start);
+  memset(&proc->end, 0, sizeof(proc->end));
+  memset(&proc->rusage, 0, sizeof(proc->rusage));
+  proc->rchar = proc->wchar = -1;
+  mkcommand(job, proc, argv);
+  set_state(job, proc, RUNNING);
+
+  if (pid > 0)
+    pid_insert(pid, j, p);
+}
+
+/* Must be called before changes of state collected in the ring are applied,
+ * which happens before any job is looked at. */
+void addproc(int j, pid_t pid, char **argv) {
+  newproc(j, pid, NULL, argv);
+}
+
+/* Add builtin stage to a job. The job takes ownership of the stage and frees it
+ * once the job is deleted. The thread may have finished already, in which case
+ * SIGCHLD is pending and the stage is marked as finished by the handler. */
+void addthread(int j, bstage_t *stage, char **argv) {
+  newproc(j, 0, stage, argv);
+  nthreads++;
+}
+
+/* Add resources used by a process to the sum. */
+void rusage_add(struct rusage *sum, const struct rusage *ru) {
+  timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+  timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+  if (ru->ru_maxrss > sum->ru_maxrss)
+    sum->ru_maxrss = ru->ru_maxrss;
+  sum->ru_nvcsw += ru->ru_nvcsw;
+  sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* Sum up resources used by processes of a job that have been reaped.
+ * Max RSS is the largest of its processes. */
+static void jobusage(job_t *job, struct rusage *usage) {
+  memset(usage, 0, sizeof(struct rusage));
+  for (int i = 0; i < job->nproc; i++)
+    rusage_add(usage, &job->proc[i].rusage);
 }
 
 /* Returns job's state.
  * If it's finished, delete it and return exitcode through statusp. */
 int jobstate(int j, int *statusp) {
   assert(j < njobmax);
+  update_jobs();
   job_t *job = &jobs[j];
   int state = job->state;
 
@@ -180,9 +758,37 @@ char *jobcmd(int j) {
   return job->command;
 }
 
+/* Give the terminal to a job. Its processes may have been reaped already,
+ * and with them its process group, which is not an error. */
+static void givetty(int j) {
+  if (tcsetpgrp(tty_fd, jobs[j].pgid) < 0 && errno != EPERM && errno != ESRCH)
+    unix_error("Tcsetpgrp error");
+}
+
+/* Send a signal to processes of a job. Without job control they're left in
+ * shell's process group, so each of them is signalled on its own. A process
+ * group that's gone belongs to a job that has finished in the meantime. */
+static void signaljob(int j, int sig) {
+  job_t *job = &jobs[j];
+
+  if (tty_fd >= 0) {
+    if (kill(-job->pgid, sig) < 0 && errno != ESRCH && errno != EPERM)
+      unix_error("Kill error");
+    return;
+  }
+
+  for (int i = 0; i < job->nproc; i++) {
+    proc_t *proc = &job->proc[i];
+    if (proc->pid > 0 && proc->state != FINISHED)
+      (void)kill(proc->pid, sig);
+  }
+}
+
 /* Continues a job that has been stopped. If move to foreground was requested,
  * then move the job to foreground and start monitoring it. */
-bool resumejob(int j, int bg, sigset_t *mask) {
+bool resumejob(int j, int bg) {
+  update_jobs();
+
   if (j < 0) {
     for (j = njobmax - 1; j > 0 && jobs[j].state == FINISHED; j--) {
       continue;
@@ -192,14 +798,36 @@ bool resumejob(int j, int bg, sigset_t *mask) {
   if (j >= njobmax || jobs[j].state == FINISHED)
     return false;
 
-  /* TODO: Continue stopped job. Possibly move job to foreground slot. */
+  /* Continue stopped job. Job moved to foreground gets the terminal before
+   * it's continued, or else a program like vim would find itself in
+   * background and stop again. */
   if (jobs[j].state == STOPPED) {
+    if (!bg && tty_fd >= 0) {
+      Tcsetattr(tty_fd, TCSADRAIN, &jobs[j].tmodes);
+      givetty(j);
+    }
+
+    /* SIGCHLD is blocked only while waiting, so it can't arrive between
+     * checking the state and going to sleep. */
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+    update_jobs();
+
+    if (use_pidfd()) {
+      signaljob(j, SIGCONT);
+      while (jobs[j].state == STOPPED)
+        wait_job(j);
+    } else {
 /* while loop was added to make sure that process received sigcont
    particularly: vim  */
-    while (jobs[j].state != RUNNING) {
-      Kill(-jobs[j].pgid, SIGCONT);
-      Sigsuspend(mask);
+      while (jobs[j].state != RUNNING) {
+        signaljob(j, SIGCONT);
+        Sigsuspend(&mask);
+        update_jobs();
+      }
     }
+
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
   }
 
   watchjobs(RUNNING);
@@ -207,7 +835,7 @@ bool resumejob(int j, int bg, sigset_t *mask) {
   /* foreground job */
   if (!bg) {
     movejob(j, FG);
-    (void) monitorjob(mask);
+    (void) monitorjob(NULL);
   }
 
   return true;
@@ -215,6 +843,7 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
 /* Kill the job by sending it a SIGTERM. */
 bool killjob(int j) {
+  update_jobs();
   if (j >= njobmax || jobs[j].state == FINISHED) {
     return false;
   }
@@ -222,91 +851,262 @@ bool killjob(int j) {
 
   /* TODO: I love the smell of napalm in the morning. */
   if (jobs[j].state == STOPPED) {
-    Kill(-jobs[j].pgid, SIGCONT);
+    signaljob(j, SIGCONT);
   }
 
-  Kill(-jobs[j].pgid, SIGTERM);
+  signaljob(j, SIGTERM);
 
   return true;
 }
 
-/* Report state of requested background jobs. Clean up finished jobs. */
-void watchjobs(int which) {
-  for (int j = BG; j < njobmax; j++) {
-    if (jobs[j].pgid == 0) {
-      continue;
+/* Resources used by a process: taken from rusage once it has been reaped,
+ * sampled from /proc while it's alive. */
+static void proc_usage(proc_t *proc, usage_t *usage) {
+  struct rusage *ru = &proc->rusage;
+  char buf[4096];
+
+  if (proc->state == FINISHED || proc->pid == 0) {
+    usage->cpu = (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000 +
+                 (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000;
+    usage->maxrss = ru->ru_maxrss;
+    usage->rchar = proc->rchar;
+    usage->wchar = proc->wchar;
+    return;
+  }
+
+  /* utime & stime are 14th and 15th field, command name may contain spaces
+   * so the fields are counted from the end of it. */
+  usage->cpu = 0;
+  if (read_proc(proc->pid, "stat", buf, sizeof(buf))) {
+    char *p = strrchr(buf, ')');
+    for (int field = 2; p && field < 14; field++)
+      p = strchr(p + 1, ' ');
+    if (p) {
+      long utime = strtol(p, &p, 10);
+      long stime = strtol(p, &p, 10);
+      usage->cpu = (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
     }
+  }
 
-    /* TODO: Report job number, state, command and exit code or signal. */
-    int statusp;
-    int state;
-
-    state = jobs[j].state;
-    if (state == which || which == ALL) {
-      statusp = exitcode(&jobs[j]);
-      if (state == RUNNING) {
-        if (statusp != -1 && WIFCONTINUED(statusp)) {
-          msg("[%d] continue '%s'\n", j, jobcmd(j));
-        } else {
-          msg("[%d] running '%s'\n", j, jobcmd(j));
-          jobs[j].proc[jobs[j].nproc - 1].exitcode = -1;
-        }
-      } else if (state == STOPPED && statusp != -1) {
-        msg("[%d] suspended '%s'\n", j, jobcmd(j));
-        jobs[j].proc[jobs[j].nproc - 1].exitcode = -1;
-      } else if (state == FINISHED) {
-        if (WIFEXITED(statusp)) {
-          msg("[%d] exited '%s', status=%d\n", j, jobcmd(j), WEXITSTATUS(statusp));
-        } else if (WIFSIGNALED(statusp)) {
-          msg("[%d] killed '%s' by signal %d\n", j, jobcmd(j), WTERMSIG(statusp));
-        }
-        deljob(&jobs[j]);
-      }
+  usage->maxrss = 0;
+  if (read_proc(proc->pid, "status", buf, sizeof(buf)))
+    usage->maxrss = proc_field(buf, "VmHWM:");
+
+  sample_io(proc->pid, &usage->rchar, &usage->wchar);
+}
+
+/* Sum up resources used by stages of a job. */
+static void job_usage(job_t *job, usage_t *usage) {
+  usage->cpu = usage->maxrss = 0;
+  usage->rchar = usage->wchar = -1;
+
+  for (int i = 0; i < job->nproc; i++) {
+    usage_t pu;
+    proc_usage(&job->proc[i], &pu);
+    usage->cpu += pu.cpu;
+    if (pu.maxrss > usage->maxrss)
+      usage->maxrss = pu.maxrss;
+    if (pu.rchar >= 0) {
+      usage->rchar = max(usage->rchar, 0) + pu.rchar;
+      usage->wchar = max(usage->wchar, 0) + pu.wchar;
+    }
+  }
+}
+
+static const char *fmt_bytes(char *buf, long n) {
+  static const char units[] = "BKMGT";
+  int u = 0;
+
+  if (n < 0)
+    return "-";
+  if (n < 1024) {
+    sprintf(buf, "%ldB", n);
+    return buf;
+  }
+
+  double v = n;
+  while (v >= 1024 && units[u + 1]) {
+    v /= 1024;
+    u++;
+  }
+  sprintf(buf, "%.1f%c", v, units[u]);
+  return buf;
+}
+
+static const char *fmt_usage(char *buf, usage_t *usage) {
+  char rss[16], rd[16], wr[16];
+  sprintf(buf, "cpu %ld.%02lds rss %s io %s/%s", usage->cpu / 1000,
+          usage->cpu % 1000 / 10, fmt_bytes(rss, usage->maxrss * 1024),
+          fmt_bytes(rd, usage->rchar), fmt_bytes(wr, usage->wchar));
+  return buf;
+}
+
+/* Listing requested by 'jobs' goes to builtin output, notifications about
+ * changes of state go to standard error. */
+#define report(...) fprintf(stream, __VA_ARGS__)
+
+static const char *proc_state(proc_t *proc) {
+  if (proc->state == RUNNING)
+    return "running";
+  if (proc->state == STOPPED)
+    return "stopped";
+  return WIFSIGNALED(proc->exitcode) ? "killed" : "exited";
+}
+
+/* Report state of a job if it matches which. Finished jobs are reported with
+ * resources they used and cleaned up. If verbose, resources used by the job
+ * and each of its stages are reported as well. */
+static void watchjob(FILE *stream, int j, int which, bool verbose) {
+  job_t *job = &jobs[j];
+  int state = job->state;
+  int statusp = exitcode(job);
+  char buf[128];
+
+  if (state != which && which != ALL)
+    return;
+
+  /* TODO: Report job number, state, command and exit code or signal. */
+  if (state == RUNNING) {
+    if (statusp != -1 && WIFCONTINUED(statusp)) {
+      report("[%d] continue '%s'", j, jobcmd(j));
+    } else {
+      report("[%d] running '%s'", j, jobcmd(j));
+      job->proc[job->nproc - 1].exitcode = -1;
     }
+  } else if (state == STOPPED && (statusp != -1 || which == ALL)) {
+    report("[%d] suspended '%s'", j, jobcmd(j));
+    job->proc[job->nproc - 1].exitcode = -1;
+  } else if (state == FINISHED && WIFEXITED(statusp)) {
+    report("[%d] exited '%s', status=%d", j, jobcmd(j), WEXITSTATUS(statusp));
+  } else if (state == FINISHED && WIFSIGNALED(statusp)) {
+    report("[%d] killed '%s' by signal %d", j, jobcmd(j), WTERMSIG(statusp));
+  } else {
+    return;
+  }
+
+  if (state == FINISHED || verbose) {
+    usage_t usage;
+    job_usage(job, &usage);
+    report(", %s", fmt_usage(buf, &usage));
+  }
+  report("\n");
+
+  for (int i = 0; verbose && i < job->nproc; i++) {
+    proc_t *proc = &job->proc[i];
+    usage_t usage;
+    proc_usage(proc, &usage);
+    if (proc->pid) {
+      report("  %7d", proc->pid);
+    } else {
+      report("  builtin");
+    }
+    report(" %s '%.*s', %s\n", proc_state(proc), proc->cmdlen,
+           job->command + proc->cmdpos, fmt_usage(buf, &usage));
+  }
+
+  if (state == FINISHED)
+    deljob(job);
+}
+
+/* Report state of requested background jobs. Clean up finished jobs.
+ * Reports are collected and written out at once, so a burst of jobs that
+ * finished together doesn't cost a system call per line. */
+void watchjobs(int which) {
+  update_jobs();
+  if (TAILQ_EMPTY(&job_list[which]))
+    return;
+
+  char *buf;
+  size_t len;
+  FILE *stream = open_memstream(&buf, &len);
+
+  job_t *job, *next;
+  TAILQ_FOREACH_SAFE(job, &job_list[which], link, next) {
+    watchjob(stream, job - jobs, which, false);
+  }
+  shrinkjobs();
+
+  fclose(stream);
+  Write(STDERR_FILENO, buf, len);
+  free(buf);
+}
+
+/* List all background jobs, for 'jobs' builtin. If verbose, report resources
+ * used by the jobs and their stages. */
+void listjobs(bool verbose) {
+  update_jobs();
+
+  int j;
+  for (bit_ffs_at(jobs_used, BG, njobmax, &j); j >= 0;
+       bit_ffs_at(jobs_used, j + 1, njobmax, &j)) {
+    watchjob(builtin_out, j, ALL, verbose);
   }
 }
 
 /* Monitor job execution. If it gets stopped move it to background.
- * When a job has finished or has been stopped move shell to foreground. */
-int monitorjob(sigset_t *mask) {
+ * When a job has finished or has been stopped move shell to foreground.
+ * If usage is not NULL, resources used by the job are stored there. */
+int monitorjob(struct rusage *usage) {
   int status, state;
 
   /* TODO: Following code requires use of Tcsetpgrp of tty_fd. */
-  sigset_t old_mask;
   status = -1;
-  Tcgetattr(tty_fd, &jobs[FG].tmodes);
-  Tcsetpgrp(tty_fd, jobs[FG].pgid);
+  if (tty_fd >= 0)
+    givetty(FG);
+  holdchildren(false);
 
-  Sigprocmask(SIG_SETMASK, mask, &old_mask);
+  /* SIGCHLD is blocked while waiting, so no change can slip in between
+   * checking the state and going to sleep. */
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  update_jobs();
 
+  if (use_pidfd()) {
+    /* Every change is received by wait_job. */
+    while (jobs[FG].state == RUNNING)
+      wait_job(FG);
+  } else {
 /* if condition of while is true then we now that there is a race
    and we have to continue stopped job
    particularly: while was added to handle vim command
    (because vim send to itself sigtstp when it is a background job
    and nearly every time race occurred) */
-  while (jobs[FG].state == STOPPED) {
-    Kill(-jobs[FG].pgid, SIGCONT);
-    Sigsuspend(mask);
-  }
+    while (jobs[FG].state == STOPPED) {
+      signaljob(FG, SIGCONT);
+      Sigsuspend(&mask);
+      update_jobs();
+    }
 
-  while ((state = jobs[FG].state) == RUNNING) {
-    Sigsuspend(mask);
+    while ((state = jobs[FG].state) == RUNNING) {
+      Sigsuspend(&mask);
+      update_jobs();
+    }
   }
 
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
   state = jobs[FG].state;
-  Sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+  if (usage)
+    jobusage(&jobs[FG], usage);
 
   if (state == STOPPED) {
-    Tcsetpgrp(tty_fd, getpgrp());
-    Tcsetattr(tty_fd, 0, &shell_tmodes);
+    if (tty_fd >= 0) {
+      /* save terminal parameters of the job, so they're restored by 'fg' */
+      Tcgetattr(tty_fd, &jobs[FG].tmodes);
+      Tcsetpgrp(tty_fd, getpgrp());
+      Tcsetattr(tty_fd, 0, &shell_tmodes);
+    }
     int j = allocjob();
     jobs[j].state = STOPPED;
     movejob(FG, j);
     watchjobs(STOPPED);
   } else if (state == FINISHED) {
-    Tcsetpgrp(tty_fd, getpgrp());
-    /* restore terminal parameters */
-    Tcsetattr(tty_fd, 0, &shell_tmodes);
+    if (tty_fd >= 0) {
+      Tcsetpgrp(tty_fd, getpgrp());
+      /* restore terminal parameters */
+      Tcsetattr(tty_fd, 0, &shell_tmodes);
+    }
     status = exitcode(&jobs[FG]);
     watchjobs(FINISHED);
     deljob(&jobs[FG]);
@@ -316,11 +1116,25 @@ int monitorjob(sigset_t *mask) {
 }
 
 /* Called just at the beginning of shell's life. */
-void initjobs(void) {
+void initjobs(bool interactive) {
   Signal(SIGCHLD, sigchld_handler);
-  jobs = calloc(sizeof(job_t), 1);
+  resizejobs(JOBS_CHUNK);
 
-  /* Assume we're running in interactive mode, so move us to foreground.
+  /* Jobs are monitored with pidfds and signalfd if the kernel supports them,
+   * otherwise with SIGCHLD handler and sigsuspend. */
+#ifdef SYS_pidfd_open
+  int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+  if (pidfd >= 0) {
+    close(pidfd);
+    sigchld_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  }
+#endif
+
+  /* Terminal is not controlled in non-interactive mode. */
+  if (!interactive)
+    return;
+
+  /* In interactive mode move us to foreground.
    * Duplicate terminal fd, but do not leak it to subprocesses that execve. */
   assert(isatty(STDIN_FILENO));
   tty_fd = Dup(STDIN_FILENO);
@@ -333,16 +1147,56 @@ void initjobs(void) {
   Tcgetattr(tty_fd, &shell_tmodes);
 }
 
+/* Called in a subshell just after Fork. Jobs of the parent shell are not
+ * children of the subshell, so they're forgotten, and so is the terminal, as
+ * the subshell runs its commands without job control. */
+void forgetjobs(void) {
+  for (int j = 0; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->pgid == 0)
+      continue;
+    for (int p = 0; p < job->nproc; p++) {
+      if (job->proc[p].pidfd >= 0)
+        close(job->proc[p].pidfd);
+      free(job->proc[p].stage);
+    }
+    if (job->arena == NULL) {
+      free(job->command);
+      free(job->proc);
+    }
+  }
+
+  /* Threads of builtin stages are not copied by Fork. */
+  nthreads = 0;
+  memset(jobs, 0, sizeof(job_t) * njobmax);
+  memset(jobs_used, 0, bitstr_size(njobmax));
+  resizejobs(JOBS_CHUNK);
+
+  free(pidtab);
+  pidtab = NULL;
+  pidcap = pidused = pidlive = 0;
+
+  if (tty_fd >= 0) {
+    Close(tty_fd);
+    tty_fd = -1;
+  }
+}
+
 /* Called just before the shell finishes. */
 void shutdownjobs(void) {
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
-  /* TODO: Kill remaining jobs and wait for them to finish. */
+  /* Kill remaining jobs and wait for them to finish. All of them are
+   * signalled first, so they die in parallel. */
+  update_jobs();
+  for (int j = BG; j < njobmax; ++j)
+    (void)killjob(j);
+
   for (int j = BG; j < njobmax; ++j) {
-    if (jobs[j].state != FINISHED) {
-      killjob(j);
+    while (jobs[j].state != FINISHED) {
       Sigsuspend(&mask);
+      update_jobs();
     }
   }
 
@@ -350,5 +1204,6 @@ void shutdownjobs(void) {
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
-  Close(tty_fd);
+  if (tty_fd >= 0)
+    Close(tty_fd);
 }
@@ -0,0 +1,92 @@
+#include "csapp.h"
+
+/* Arena (bump) allocator. Memory is carved out of chunks obtained with malloc
+ * and is released all at once with arena_reset or arena_destroy. */
+
+struct arena_chunk {
+  struct arena_chunk *next; /* previously used chunk */
+  size_t size;              /* usable size of data */
+  char data[] __attribute__((aligned(16)));
+};
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK 4096
+
+void arena_init(arena_t *arena) {
+  arena->chunk = NULL;
+  arena->ptr = NULL;
+  arena->end = NULL;
+}
+
+static void arena_grow(arena_t *arena, size_t size) {
+  size_t chunk_size = arena->chunk ? arena->chunk->size * 2 : ARENA_CHUNK;
+  while (chunk_size < size)
+    chunk_size *= 2;
+
+  arena_chunk_t *chunk = Malloc(sizeof(arena_chunk_t) + chunk_size);
+  chunk->next = arena->chunk;
+  chunk->size = chunk_size;
+  arena->chunk = chunk;
+  arena->ptr = chunk->data;
+  arena->end = chunk->data + chunk_size;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (arena->end - arena->ptr < size)
+    arena_grow(arena, size);
+  void *p = arena->ptr;
+  arena->ptr += size;
+  return p;
+}
+
+char *arena_strdup(arena_t *arena, const char *s) {
+  size_t len = strlen(s) + 1;
+  return memcpy(arena_alloc(arena, len), s, len);
+}
+
+/* Resize a block of memory. The last block allocated from the arena is grown
+ * in place if the chunk has room, other ones are copied. */
+void *arena_realloc(arena_t *arena, void *ptr, size_t oldsize, size_t size) {
+  size_t old = (oldsize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  size_t new = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if (ptr != NULL && (char *)ptr + old == arena->ptr &&
+      arena->end - (char *)ptr >= new) {
+    arena->ptr = (char *)ptr + new;
+    return ptr;
+  }
+
+  void *p = arena_alloc(arena, size);
+  if (ptr != NULL)
+    memcpy(p, ptr, oldsize < size ? oldsize : size);
+  return p;
+}
+
+/* Copy a block of memory to the heap, when it has to outlive the arena. */
+void *arena_promote(const void *ptr, size_t size) {
+  return memcpy(Malloc(size), ptr, size);
+}
+
+/* Release all memory, but keep the last (and the largest) chunk,
+ * so an arena that is reset regularly stops calling malloc. */
+void arena_reset(arena_t *arena) {
+  arena_chunk_t *chunk = arena->chunk;
+  if (chunk == NULL)
+    return;
+
+  arena_chunk_t *next;
+  for (arena_chunk_t *old = chunk->next; old; old = next) {
+    next = old->next;
+    free(old);
+  }
+
+  chunk->next = NULL;
+  arena->ptr = chunk->data;
+}
+
+void arena_destroy(arena_t *arena) {
+  arena_reset(arena);
+  free(arena->chunk);
+  arena_init(arena);
+}
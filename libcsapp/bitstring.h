@@ -37,6 +37,9 @@
 #ifndef _BITSTRING_H_
 #define _BITSTRING_H_
 
+#include <stdint.h>
+#include <string.h>
+
 /* modified for SV/AT and bitstring bugfix by M.R.Murphy, 11oct91
  * bitstr_size changed gratuitously, but shorter
  * bit_alloc   spelling error fixed
@@ -107,32 +110,59 @@ typedef unsigned char bitstr_t;
     }                                                                          \
   } while (/*CONSTCOND*/ 0)
 
+/*
+ * Find first bit at or after start that is clear (or set, if clear is 0),
+ * returns -1 if there's none. Whole 64-bit words are examined at a time once
+ * the scan reaches a byte boundary. Bit N is bit (N & 7) of byte (N >> 3),
+ * so on little-endian machines a word loaded from memory keeps bits in order.
+ */
+static inline int _bit_find(const bitstr_t *name, size_t start, size_t nbits,
+                            int clear) {
+  size_t bit = start;
+
+  while (bit < nbits) {
+    uint64_t word;
+    unsigned n;
+
+    if ((bit & 7) == 0 && nbits - bit >= 64) {
+      memcpy(&word, &name[_bit_byte(bit)], sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      n = 64;
+    } else {
+      word = name[_bit_byte(bit)] >> (bit & 7);
+      n = 8 - (bit & 7);
+    }
+
+    if (clear)
+      word = ~word;
+    if (n < 64)
+      word &= (1ULL << n) - 1;
+    if (word != 0) {
+      bit += __builtin_ctzll(word);
+      return bit < nbits ? (int)bit : -1;
+    }
+    bit += n;
+  }
+
+  return -1;
+}
+
 /* find first bit clear in name */
 #define bit_ffc(name, nbits, value)                                            \
-  do {                                                                         \
-    const bitstr_t *_name = name;                                              \
-    size_t _bit, _nbits = nbits;                                               \
-    int _value = -1;                                                           \
-    for (_bit = 0; _bit < _nbits; ++_bit)                                      \
-      if (!bit_test(_name, _bit)) {                                            \
-        _value = _bit;                                                         \
-        break;                                                                 \
-      }                                                                        \
-    *(value) = _value;                                                         \
-  } while (/*CONSTCOND*/ 0)
+  (*(value) = _bit_find((name), 0, (nbits), 1))
 
 /* find first bit set in name */
 #define bit_ffs(name, nbits, value)                                            \
-  do {                                                                         \
-    const bitstr_t *_name = name;                                              \
-    size_t _bit, _nbits = nbits;                                               \
-    int _value = -1;                                                           \
-    for (_bit = 0; _bit < _nbits; ++_bit)                                      \
-      if (bit_test(_name, _bit)) {                                             \
-        _value = _bit;                                                         \
-        break;                                                                 \
-      }                                                                        \
-    *(value) = _value;                                                         \
-  } while (/*CONSTCOND*/ 0)
+  (*(value) = _bit_find((name), 0, (nbits), 0))
+
+/* find first bit clear in name, starting at bit start */
+#define bit_ffc_at(name, start, nbits, value)                                  \
+  (*(value) = _bit_find((name), (start), (nbits), 1))
+
+/* find first bit set in name, starting at bit start */
+#define bit_ffs_at(name, start, nbits, value)                                  \
+  (*(value) = _bit_find((name), (start), (nbits), 0))
 
 #endif /* !_BITSTRING_H_ */
@@ -1,6 +1,9 @@
 #include "csapp.h"
 
+long heap_allocs = 0;
+
 void *Malloc(size_t size) {
+  heap_allocs++;
   void *p = malloc(size);
   if (!p)
     unix_error("Malloc error");
@@ -8,6 +11,7 @@ void *Malloc(size_t size) {
 }
 
 void *Realloc(void *ptr, size_t size) {
+  heap_allocs++;
   void *p = realloc(ptr, size);
   if (!p)
     unix_error("Realloc error");
@@ -15,6 +19,7 @@ void *Realloc(void *ptr, size_t size) {
 }
 
 void *Calloc(size_t nmemb, size_t size) {
+  heap_allocs++;
   void *p = calloc(nmemb, size);
   if (!p)
     unix_error("Calloc error");
@@ -0,0 +1,261 @@
+#include "shell.h"
+
+/*
+ * Grammar of a command line:
+ *
+ *   list     : andor ((';' | '&') andor)* [';' | '&']
+ *   andor    : pipeline (('&&' | '||') pipeline)*
+ *   pipeline : ['time'] ['!'] ['PIPESIZE=' size] command ('|' command)*
+ *   command  : (word | procsub | redir)+
+ *   procsub  : ('<(' | '>(') pipeline ')'
+ *   redir    : [number] ('<' | '>' | '>>') word
+ *            | [number] ('<&' | '>&') (number | '-')
+ *            | [number] ('<<' | '<<<') word
+ *            | ('&>' | '&>>') word
+ *
+ * Words are split and unquoted by the lexer, see tokenize. For '<<' it
+ * replaces the delimiter with the body of here-document that follows the line.
+ * Pipeline of process substitution is passed as a word and parsed on its own.
+ * Every level of the tree is stored in an array allocated from the arena.
+ * Since there are no parentheses in the grammar, the size of an array can be
+ * found by counting operators ahead of the current position.
+ */
+
+typedef struct {
+  token_t *token; /* token vector returned by tokenize */
+  char **glob;    /* glob patterns of tokens */
+  int ntokens;    /* number of tokens */
+  int pos;        /* index of current token */
+  arena_t *arena; /* memory for the tree */
+} parser_t;
+
+#define list_op_p(t) ((t) == T_COLON || (t) == T_BGJOB)
+#define andor_op_p(t) ((t) == T_AND || (t) == T_OR)
+#define redir_op_p(t)                                                          \
+  ((t) == T_INPUT || (t) == T_OUTPUT || (t) == T_APPEND || dup_op_p(t) ||      \
+   (t) == T_OUTERR || (t) == T_APPENDERR || here_op_p(t))
+#define dup_op_p(t) ((t) == T_DUPIN || (t) == T_DUPOUT)
+#define here_op_p(t) ((t) == T_HEREDOC || (t) == T_HERESTR)
+#define psub_op_p(t) ((t) == T_PSUBIN || (t) == T_PSUBOUT)
+
+static token_t peek(parser_t *p) {
+  return p->pos < p->ntokens ? p->token[p->pos] : T_NULL;
+}
+
+/* Count tokens satisfying the predicate up to the end of enclosing level. */
+#define count_ahead(p, pred, stop)                                             \
+  ({                                                                           \
+    int _n = 0;                                                                \
+    for (int _i = (p)->pos; _i < (p)->ntokens; _i++) {                         \
+      token_t _t = (p)->token[_i];                                             \
+      if (stop(_t))                                                            \
+        break;                                                                 \
+      if (pred(_t))                                                            \
+        _n++;                                                                  \
+    }                                                                          \
+    _n;                                                                        \
+  })
+
+#define never_p(t) false
+#define andor_end_p(t) list_op_p(t)
+#define pipeline_end_p(t) ((t) == T_NULL || list_op_p(t) || andor_op_p(t))
+#define command_end_p(t) (pipeline_end_p(t) || (t) == T_PIPE)
+#define pipe_p(t) ((t) == T_PIPE)
+#define word_p(t) string_p(t)
+
+/* Descriptor to copy is given by its number, or "-" to close one. */
+static bool fd_word_p(const char *word) {
+  if (!strcmp(word, "-"))
+    return true;
+  return *word && strspn(word, "0123456789") == strlen(word);
+}
+
+static pipeline_t *parse_procsub(const char *text, arena_t *arena);
+
+static bool parse_command(parser_t *p, cmd_t *cmd) {
+  int nredir = count_ahead(p, redir_op_p, command_end_p);
+  int nwords = count_ahead(p, word_p, command_end_p);
+  int npsub = count_ahead(p, psub_op_p, command_end_p);
+
+  /* Words include file names of redirections, that's an upper bound. */
+  cmd->argv = arena_alloc(p->arena, sizeof(char *) * (nwords + 1));
+  cmd->glob = arena_alloc(p->arena, sizeof(char *) * (nwords + 1));
+  cmd->redir = arena_alloc(p->arena, sizeof(redir_t) * nredir);
+  cmd->psub = arena_alloc(p->arena, sizeof(procsub_t) * npsub);
+  cmd->argc = 0;
+  cmd->nredir = 0;
+  cmd->npsub = 0;
+  cmd->exec = arena_alloc(p->arena, sizeof(exec_t));
+  memset(cmd->exec, 0, sizeof(exec_t));
+  cmd->exec->arena = p->arena;
+
+  token_t t;
+  while (!command_end_p(t = peek(p))) {
+    p->pos++;
+
+    /* number of descriptor that precedes redirection operator */
+    int fd = -1;
+    if (t == T_IONUMBER && string_p(peek(p))) {
+      long n = strtol(p->token[p->pos++], NULL, 10);
+      fd = n < INT_MAX ? n : INT_MAX;
+      t = peek(p);
+      p->pos++;
+    }
+
+    if (string_p(t) && fd < 0) {
+      cmd->glob[cmd->argc] = p->glob[p->pos - 1];
+      cmd->argv[cmd->argc++] = t;
+    } else if (redir_op_p(t) && string_p(peek(p))) {
+      redir_t *redir = &cmd->redir[cmd->nredir++];
+      redir->mode = t;
+      if (fd < 0)
+        fd = (t == T_INPUT || t == T_DUPIN || here_op_p(t)) ? STDIN_FILENO
+                                                             : STDOUT_FILENO;
+      redir->fd = fd;
+      redir->glob = here_op_p(t) ? NULL : p->glob[p->pos];
+      redir->path = p->token[p->pos++];
+      if (dup_op_p(t) && !fd_word_p(redir->path))
+        return false;
+    } else if (psub_op_p(t) && fd < 0 && string_p(peek(p))) {
+      /* descriptors are given out from the top */
+      procsub_t *psub = &cmd->psub[cmd->npsub];
+      psub->mode = t;
+      psub->fd = FD_PSUB - 1 - cmd->npsub++;
+      psub->pipeline = parse_procsub(p->token[p->pos++], p->arena);
+      if (psub->fd < FD_USER || psub->pipeline == NULL)
+        return false;
+      char *path = arena_alloc(p->arena, sizeof("/dev/fd/NN"));
+      sprintf(path, "/dev/fd/%d", psub->fd);
+      cmd->glob[cmd->argc] = NULL;
+      cmd->argv[cmd->argc++] = path;
+    } else {
+      return false;
+    }
+  }
+
+  cmd->argv[cmd->argc] = NULL;
+  cmd->glob[cmd->argc] = NULL;
+  return cmd->argc > 0;
+}
+
+/* Parse size given in bytes, or with K or M suffix. */
+bool parse_size(const char *str, int *sizep) {
+  char *end;
+  long size = strtol(str, &end, 10);
+
+  if (end == str || size < 0)
+    return false;
+  if (*end == 'K' || *end == 'k') {
+    size <<= 10;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    size <<= 20;
+    end++;
+  }
+  if (*end || size > INT_MAX)
+    return false;
+
+  *sizep = size;
+  return true;
+}
+
+#define PIPESIZE "PIPESIZE="
+
+static bool parse_pipeline(parser_t *p, pipeline_t *pipeline) {
+  pipeline->timed = false;
+  if (string_p(peek(p)) && !strcmp(peek(p), "time")) {
+    pipeline->timed = true;
+    p->pos++;
+  }
+
+  pipeline->negate = false;
+  if (peek(p) == T_BANG) {
+    pipeline->negate = true;
+    p->pos++;
+  }
+
+  pipeline->pipesize = 0;
+  token_t t = peek(p);
+  if (string_p(t) && !strncmp(t, PIPESIZE, strlen(PIPESIZE))) {
+    if (!parse_size(t + strlen(PIPESIZE), &pipeline->pipesize))
+      return false;
+    p->pos++;
+  }
+
+  int ncmd = count_ahead(p, pipe_p, pipeline_end_p) + 1;
+  pipeline->cmd = arena_alloc(p->arena, sizeof(cmd_t) * ncmd);
+  pipeline->ncmd = 0;
+
+  while (true) {
+    if (!parse_command(p, &pipeline->cmd[pipeline->ncmd++]))
+      return false;
+    if (peek(p) != T_PIPE)
+      return true;
+    p->pos++;
+  }
+}
+
+static bool parse_andor(parser_t *p, andor_t *andor) {
+  int npipeline = count_ahead(p, andor_op_p, andor_end_p) + 1;
+  andor->pipeline = arena_alloc(p->arena, sizeof(pipeline_t) * npipeline);
+  andor->npipeline = 0;
+
+  while (true) {
+    pipeline_t *pipeline = &andor->pipeline[andor->npipeline++];
+    if (!parse_pipeline(p, pipeline))
+      return false;
+    pipeline->next = peek(p);
+    if (!andor_op_p(pipeline->next))
+      break;
+    p->pos++;
+  }
+
+  andor->bg = (peek(p) == T_BGJOB);
+  return true;
+}
+
+/* Process substitution is a single pipeline, possibly with process
+ * substitutions of its own. */
+static pipeline_t *parse_procsub(const char *text, arena_t *arena) {
+  pipeline_t *pipeline = NULL;
+  lexer_t lx;
+
+  lexer_init(&lx);
+  lexer_feed(&lx, text, strlen(text));
+  if (lexer_scan(&lx, true) == LEX_LINE && lx.pos == lx.len) {
+    int ntokens;
+    char **glob;
+    char *line = arena_strdup(arena, lx.line);
+    token_t *token = tokenize(&lx, line, &glob, &ntokens, arena);
+    list_t *list = parse(token, glob, ntokens, arena);
+    if (list && list->nandor == 1 && list->andor[0].npipeline == 1 &&
+        !list->andor[0].bg)
+      pipeline = &list->andor[0].pipeline[0];
+  }
+  lexer_destroy(&lx);
+  return pipeline;
+}
+
+/* Build syntax tree from tokens. Returns NULL if the line is malformed.
+ * Tree references words of the tokenized line, so it must outlive the tree. */
+list_t *parse(token_t *token, char **glob, int ntokens, arena_t *arena) {
+  parser_t p = {.token = token,
+                .glob = glob,
+                .ntokens = ntokens,
+                .pos = 0,
+                .arena = arena};
+
+  int nandor = count_ahead(&p, list_op_p, never_p) + 1;
+  list_t *list = arena_alloc(arena, sizeof(list_t));
+  list->andor = arena_alloc(arena, sizeof(andor_t) * nandor);
+  list->nandor = 0;
+
+  while (p.pos < ntokens) {
+    if (!parse_andor(&p, &list->andor[list->nandor++]))
+      return NULL;
+    /* consume list operator */
+    p.pos++;
+  }
+
+  return list;
+}
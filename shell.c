@@ -1,17 +1,32 @@
 #include <stdio.h>
 #include <glob.h>
+#include <spawn.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include "rio.h"
 
 #define DEBUG 0
 #include "shell.h"
 
 sigset_t sigchld_mask;
-
-static sigjmp_buf loop_env;
-
+static sigset_t child_mask; /* signal mask of subprocesses */
+static bool interactive;    /* commands are read from a terminal */
+
+int opt_spawn = 1;
+int opt_stats = 0;
+int opt_cache = 1;
+int opt_pipesize = 0;
+int opt_pidfd = 1;
+stats_t stats;
+
+/* SIGINT received while a command is executed must not kill the shell. The
+ * handler is installed by signal(), which sets SA_RESTART, so system calls it
+ * lands in are restarted rather than interrupted. */
 static void sigint_handler(int sig) {
-  siglongjmp(loop_env, sig);
 }
 
 /* Rewrite closed file descriptors to -1,
@@ -23,255 +38,959 @@ static void MaybeClose(int *fdp) {
   *fdp = -1;
 }
 
-/* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
-static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
-  token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-  int n = 0;           /* number of tokens after redirections are removed */
-
-  for (int i = 0; i < ntokens; i++) {
-    /* Handle tokens and open files as requested. */
-     mode = token[i];
-    if (separator_p(mode)) {
-      token[n] = token[i];
-      n++;
-    } else if (string_p(mode)) {
-      token[n] = token[i];
-      n++;
-    } else {
-      /* if there are more than one mathing file name, choose the first one */
-      assert(i + 1 < ntokens);
-      glob_t globbuf;
-      globbuf.gl_offs = 0;
-      glob(token[i+1], GLOB_DOOFFS , NULL, &globbuf);
-
-      if (globbuf.gl_pathc > 0) {
-        strcpy(token[i + 1], globbuf.gl_pathv[0]);
-      }
+/* Descriptors the shell creates may have numbers below FD_USER too, so they're
+ * moved into place only in subprocesses, just before execve. */
+#define FD_SAME -2 /* descriptor is inherited as it is */
+
+/* Descriptors 3 ... FD_USER - 1 opened with 'exec' builtin. They're kept at
+ * numbers >= FD_USER and passed to every subprocess. -1 if not open. */
+static int fdtab[FD_USER] = {[0 ... FD_USER - 1] = -1};
+
+/* Descriptors of a subprocess: fd[n] is the descriptor of the shell that
+ * becomes n, -1 if n is closed or FD_SAME. Only descriptors below nfd are
+ * looked at, which are more than FD_USER only if process substitutions are
+ * given some. Files opened for redirections are closed by the shell once the
+ * subprocess is started. */
+typedef struct {
+  int fd[FD_PSUB];
+  int nfd;
+  int opened[2 * FD_PSUB];
+  int nopened;
+} fdmap_t;
+
+static void fdmap_init(fdmap_t *map, int input, int output) {
+  for (int n = 0; n < FD_USER; n++)
+    map->fd[n] = fdtab[n] >= 0 ? fdtab[n] : FD_SAME;
+  if (input != -1)
+    map->fd[STDIN_FILENO] = input;
+  if (output != -1)
+    map->fd[STDOUT_FILENO] = output;
+  map->nfd = FD_USER;
+  map->nopened = 0;
+}
+
+/* Descriptor of the shell that n refers to, or -1 if n is not open. */
+static int fdmap_get(fdmap_t *map, int n) {
+  if (n < 0 || n >= FD_USER)
+    return -1;
+  if (map->fd[n] == FD_SAME)
+    return n <= STDERR_FILENO ? n : -1;
+  return map->fd[n];
+}
+
+/* A file that was opened for the map is closed if it's not referred to
+ * anymore. */
+static void fdmap_release(fdmap_t *map, int old) {
+  for (int i = 0; i < map->nfd; i++)
+    if (map->fd[i] == old)
+      return;
+  for (int i = 0; i < map->nopened; i++) {
+    if (map->opened[i] == old) {
+      Close(old);
+      map->opened[i] = map->opened[--map->nopened];
+      return;
+    }
+  }
+}
+
+/* Make n refer to descriptor fd. */
+static void fdmap_set(fdmap_t *map, int n, int fd) {
+  for (; map->nfd <= n; map->nfd++)
+    map->fd[map->nfd] = FD_SAME;
+  int old = map->fd[n];
+  map->fd[n] = fd;
+  fdmap_release(map, old);
+}
+
+/* Descriptors are moved into place one by one, so a descriptor that's to be
+ * copied must not be replaced before. Those are copied to a higher number. */
+static void fdmap_finish(fdmap_t *map) {
+  for (int n = 0; n < map->nfd; n++) {
+    int fd = map->fd[n];
+    if (fd < 0 || fd >= map->nfd || (fd != n && map->fd[fd] == FD_SAME))
+      continue;
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, map->nfd);
+    if (copy < 0)
+      unix_error("fcntl error");
+    map->opened[map->nopened++] = copy;
+    for (int i = 0; i < map->nfd; i++)
+      if (map->fd[i] == fd)
+        map->fd[i] = copy;
+    fdmap_release(map, fd);
+  }
+}
 
-      if (mode == T_INPUT) {
-        *inputp = open(token[i + 1], O_RDONLY, 0);
-        i++;
-        assert(*inputp >= 0); 
-      } else if (mode == T_OUTPUT) {
-        *outputp = open(token[i + 1], O_CREAT | O_WRONLY | O_TRUNC, 0666);
-        i++;
-        assert(*outputp >= 0); 
-      } else if (mode == T_APPEND) {
-        *outputp = open(token[i + 1], O_CREAT | O_WRONLY | O_APPEND, 0666);
-        i++;
-        assert(*outputp >= 0); 
-      } else {
-        /* BANG operator */
-        i++;
+static void fdmap_close(fdmap_t *map) {
+  for (int i = 0; i < map->nopened; i++)
+    Close(map->opened[i]);
+  map->nopened = 0;
+}
+
+static void mkpipe(int *readp, int *writep, int size);
+
+/* Defined by <sys/mman.h> & <fcntl.h> only with _GNU_SOURCE. */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+/* Here-documents up to this size are written into a pipe, which is resized
+ * if it's larger than the default capacity. */
+#define HERE_PIPE_MAX (1 << 20)
+#define PIPE_DEFAULT_SIZE 65536
+
+/* Make a descriptor to read text given in place from, followed by a newline
+ * for a here-string. The text is written into a pipe when it fits in one,
+ * otherwise into a sealed memory file. Neither touches the disk nor needs
+ * a process to feed the command. Returns -1 on failure. */
+static int here_document(const char *text, bool newline) {
+  struct iovec iov[2] = {{(void *)text, strlen(text)}, {"\n", newline}};
+  size_t len = iov[0].iov_len + iov[1].iov_len;
+  int fd, wfd;
+
+  if (len <= HERE_PIPE_MAX) {
+    mkpipe(&fd, &wfd, len > PIPE_DEFAULT_SIZE ? len : 0);
+    /* The pipe may be smaller if user's limit of pipe buffers is exceeded. */
+    fcntl(wfd, F_SETFL, O_NONBLOCK);
+    ssize_t n = writev(wfd, iov, 2);
+    Close(wfd);
+    if (n == len)
+      return fd;
+    Close(fd);
+  }
+
+#ifdef SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "here-document",
+               MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    msg("here-document: %s\n", strerror(errno));
+    return -1;
+  }
+  if (writev(fd, iov, 2) != len) {
+    msg("here-document: %s\n", strerror(errno));
+    Close(fd);
+    return -1;
+  }
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW |
+                             F_SEAL_WRITE);
+  Lseek(fd, 0, SEEK_SET);
+  return fd;
+#else
+  msg("here-document: too long\n");
+  return -1;
+#endif
+}
+
+/* Resolve redirections of a command, whose standard input & output may be
+ * connected to pipes (or -1 if they're not). Files are opened with O_CLOEXEC,
+ * the map tells how to put them in place. For file name patterns the first
+ * matching file is chosen. Returns false if any of the files cannot be opened
+ * or descriptor to copy isn't open. */
+static bool do_redir(cmd_t *cmd, int input, int output, fdmap_t *map) {
+  fdmap_init(map, input, output);
+
+  for (int i = 0; i < cmd->nredir; i++) {
+    redir_t *redir = &cmd->redir[i];
+    const char *path = redir->path;
+
+    if (redir->fd >= FD_USER) {
+      msg("%d: bad file descriptor\n", redir->fd);
+      return false;
+    }
+
+    if (redir->mode == T_DUPIN || redir->mode == T_DUPOUT) {
+      int fd = -1;
+      if (strcmp(path, "-")) {
+        long n = strtol(path, NULL, 10);
+        if ((fd = fdmap_get(map, n < FD_USER ? n : -1)) < 0) {
+          msg("%s: bad file descriptor\n", path);
+          return false;
+        }
       }
+      fdmap_set(map, redir->fd, fd);
+      continue;
+    }
+
+    if (redir->mode == T_HEREDOC || redir->mode == T_HERESTR) {
+      int fd = here_document(path, redir->mode == T_HERESTR);
+      if (fd < 0)
+        return false;
+      map->opened[map->nopened++] = fd;
+      fdmap_set(map, redir->fd, fd);
+      continue;
     }
+
+    glob_t globbuf;
+
+    memset(&globbuf, 0, sizeof(glob_t));
+    if (redir->glob) {
+      glob(redir->glob, 0, NULL, &globbuf);
+      stats.glob++;
+    }
+
+    if (globbuf.gl_pathc > 0)
+      path = globbuf.gl_pathv[0];
+
+    int flags = O_CREAT | O_WRONLY | O_TRUNC;
+
+    if (redir->mode == T_INPUT) {
+      flags = O_RDONLY;
+    } else if (redir->mode == T_APPEND || redir->mode == T_APPENDERR) {
+      flags = O_CREAT | O_WRONLY | O_APPEND;
+    }
+
+    int fd = open(path, flags | O_CLOEXEC, 0666);
+    if (fd < 0)
+      msg("%s: %s\n", path, strerror(errno));
+
+    globfree(&globbuf);
+
+    if (fd < 0)
+      return false;
+
+    map->opened[map->nopened++] = fd;
+    fdmap_set(map, redir->fd, fd);
+    if (redir->mode == T_OUTERR || redir->mode == T_APPENDERR)
+      fdmap_set(map, STDERR_FILENO, fd);
   }
 
-  for (int i = n; i < ntokens; ++i) {
-    token[i] = T_NULL;
+  fdmap_finish(map);
+  return true;
+}
+
+/* Move descriptors into place in a subprocess. */
+static void fdmap_apply(fdmap_t *map) {
+  for (int n = 0; n < map->nfd; n++) {
+    if (map->fd[n] == FD_SAME)
+      continue;
+    if (map->fd[n] < 0) {
+      (void)close(n);
+    } else {
+      Dup2(map->fd[n], n);
+    }
   }
+}
 
-  token[n] = NULL;
-  return n;
+/* Builtins run within the shell see redirections of standard descriptors,
+ * which are undone when they're finished. */
+static void redirect_shell(fdmap_t *map, int saved[3]) {
+  fflush(stdout);
+  for (int n = 0; n <= STDERR_FILENO; n++) {
+    saved[n] = FD_SAME;
+    if (map->fd[n] == FD_SAME)
+      continue;
+    saved[n] = fcntl(n, F_DUPFD_CLOEXEC, FD_USER);
+    if (map->fd[n] < 0) {
+      (void)close(n);
+    } else {
+      Dup2(map->fd[n], n);
+    }
+  }
 }
 
-/* Execute internal command within shell's process or execute external command
- * in a subprocess. External command can be run in the background. */
-static int do_job(token_t *token, int ntokens, bool bg) {
-  int input = -1, output = -1;
-  int exitcode = 0;
+static void restore_shell(int saved[3]) {
+  fflush(stdout);
+  for (int n = 0; n <= STDERR_FILENO; n++) {
+    if (saved[n] == FD_SAME)
+      continue;
+    if (saved[n] < 0) {
+      (void)close(n);
+    } else {
+      Dup2(saved[n], n);
+      Close(saved[n]);
+    }
+  }
+}
 
-  ntokens = do_redir(token, ntokens, &input, &output);
+/* Restore signal mask & handlers a command expects. */
+static void reset_signals(sigset_t *mask) {
+  Sigprocmask(SIG_SETMASK, mask, NULL);
+  Signal(SIGCHLD, SIG_DFL);
+  Signal(SIGINT, SIG_DFL);
+  Signal(SIGTSTP, SIG_DFL);
+  Signal(SIGTTIN, SIG_DFL);
+  Signal(SIGTTOU, SIG_DFL);
+}
 
-  assert(ntokens != 0);
+/* Move subprocess pid to process group pgid (or a new one if pgid is 0).
+ * Done by both processes, as the next stage of pipeline may join the group
+ * before this subprocess creates it. Without job control subprocesses stay
+ * in shell's process group, so they can read from the terminal and get
+ * signals generated by it. */
+static void join_group(pid_t pid, pid_t pgid) {
+  if (interactive)
+    (void)setpgid(pid, pgid ? pgid : pid);
+}
 
-  if (!bg) {
-    if ((exitcode = builtin_command(token)) >= 0)
-      return exitcode;
+/* Set up process group, signal mask & handlers and descriptors of
+ * a subprocess. Must be called in a child just after Fork. */
+static void setup_child(pid_t pgid, sigset_t *mask, fdmap_t *map) {
+  if (interactive)
+    Setpgid(0, pgid);
+  fdmap_apply(map);
+  reset_signals(mask);
+}
+
+/* Start external command with posix_spawn, which does the same work as
+ * setup_child, but does not copy shell's page tables as Fork does.
+ * Returns -1 if the command could not be started. */
+static pid_t spawn_command(pid_t pgid, sigset_t *mask, fdmap_t *map,
+                           const char *path, char **argv) {
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t actions;
+  sigset_t sigdef;
+  pid_t pid;
+
+  sigemptyset(&sigdef);
+  sigaddset(&sigdef, SIGCHLD);
+  sigaddset(&sigdef, SIGINT);
+  sigaddset(&sigdef, SIGTSTP);
+  sigaddset(&sigdef, SIGTTIN);
+  sigaddset(&sigdef, SIGTTOU);
+
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, (interactive ? POSIX_SPAWN_SETPGROUP : 0) |
+                                    POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETSIGDEF);
+  posix_spawnattr_setpgroup(&attr, pgid);
+  posix_spawnattr_setsigmask(&attr, mask);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+
+  posix_spawn_file_actions_init(&actions);
+
+  for (int n = 0; n < map->nfd; n++) {
+    if (map->fd[n] == FD_SAME)
+      continue;
+    if (map->fd[n] < 0) {
+      posix_spawn_file_actions_addclose(&actions, n);
+    } else {
+      posix_spawn_file_actions_adddup2(&actions, map->fd[n], n);
+    }
   }
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  int error = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+  debug("spawn '%s': %s\n", path, strerror(error));
 
-  /* TODO: Start a subprocess, create a job and monitor it. */
-  pid_t pid = Fork();
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
 
-  if (pid == 0) {  
-    Sigprocmask(SIG_SETMASK, &mask, NULL);
-    Setpgid(0, 0);
+  return error ? -1 : pid;
+}
+
+/* 'exec' with a command runs the command as if 'exec' wasn't given, just in
+ * place of the shell. Its results are remembered in the syntax tree of 'exec'. */
+static bool exec_p(cmd_t *cmd) {
+  return !strcmp(cmd->argv[0], "exec");
+}
 
-    if (input != -1) {
-      Dup2(input, STDIN_FILENO);
-      Close(input);
+static cmd_t *exec_command(cmd_t *cmd, cmd_t *command) {
+  if (cmd->argc == 1)
+    return NULL;
+  *command = (cmd_t){.argv = cmd->argv + 1,
+                     .glob = cmd->glob + 1,
+                     .argc = cmd->argc - 1,
+                     .exec = cmd->exec};
+  return command;
+}
+
+/* Start external command in a subprocess that is moved to process group pgid
+ * (or a new one if pgid is 0). The command is looked up in $PATH and its
+ * arguments are expanded here, once per syntax tree, so the subprocess only
+ * has to call execve. If the command cannot be spawned, fall back to Fork,
+ * so the error is reported by the subprocess. */
+static pid_t launch(pid_t pgid, sigset_t *mask, fdmap_t *map, cmd_t *cmd) {
+  cmd_t command;
+  pid_t pid = -1;
+
+  /* Bare 'exec' outside of the shell only applies redirections. */
+  if (exec_p(cmd) && (cmd = exec_command(cmd, &command)) == NULL) {
+    if ((pid = Fork()) == 0) {
+      setup_child(pgid, mask, map);
+      exit(EXIT_SUCCESS);
     }
+    join_group(pid, pgid);
+    return pid;
+  }
+
+  exec_t *exec = prepare_command(cmd);
 
-    if (output != -1) {
-      Dup2(output, STDOUT_FILENO);
-      Close(output);
+  if (exec->path != NULL) {
+    stats.exec++;
+    if (opt_spawn)
+      pid = spawn_command(pgid, mask, map, exec->path, exec->argv);
+  }
+
+  if (pid < 0) {
+    if ((pid = Fork()) == 0) {
+      setup_child(pgid, mask, map);
+      external_command(exec->path, exec->argv);
     }
+    join_group(pid, pgid);
+  }
 
-    Signal(SIGCHLD, SIG_DFL);
-    Signal(SIGINT, SIG_DFL);
-    Signal(SIGTSTP, SIG_DFL);
-    Signal(SIGTTIN, SIG_DFL);
-    Signal(SIGTTOU, SIG_DFL);
+  return pid;
+}
+
+/* Translate status of a job returned by monitorjob into an exit code.
+ * Stopped jobs and jobs killed by a signal get 128 + signal number. */
+static int exit_status(int status) {
+  if (status < 0)
+    return 128 + SIGTSTP;
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+/* 'exec' without a command applies redirections to the shell for good,
+ * otherwise the shell is replaced with the command. */
+static int exec_shell(cmd_t *cmd, fdmap_t *map) {
+  int newtab[FD_USER];
+  exec_t *exec = NULL;
+  cmd_t command;
+
+  /* Interactive shell is not replaced with a command that can't be run. */
+  if (exec_command(cmd, &command) != NULL) {
+    exec = prepare_command(&command);
+    if (interactive && exec->path == NULL) {
+      msg("exec: %s: command not found\n", command.argv[0]);
+      return 127;
+    }
+    if (interactive && access(exec->path, X_OK) < 0) {
+      msg("exec: %s: %s\n", command.argv[0], strerror(errno));
+      return 126;
+    }
+  }
+
+  fflush(stdout);
+  for (int n = 0; n <= STDERR_FILENO; n++) {
+    if (map->fd[n] == FD_SAME)
+      continue;
+    if (map->fd[n] < 0) {
+      (void)close(n);
+    } else {
+      Dup2(map->fd[n], n);
+    }
+  }
 
-    external_command(token);
+  /* Other descriptors are kept out of the way until a subprocess needs them.
+   * Descriptors that are replaced are closed when no longer referenced. */
+  for (int n = STDERR_FILENO + 1; n < FD_USER; n++) {
+    int fd = map->fd[n];
+    newtab[n] = fd < 0 ? -1 : fd;
+    if (fd >= 0 && fd != fdtab[n]) {
+      if ((newtab[n] = fcntl(fd, F_DUPFD_CLOEXEC, FD_USER)) < 0)
+        unix_error("fcntl error");
+    }
+  }
+  for (int n = STDERR_FILENO + 1; n < FD_USER; n++) {
+    if (fdtab[n] >= 0 && fdtab[n] != newtab[n])
+      Close(fdtab[n]);
+    fdtab[n] = newtab[n];
   }
 
+  if (exec == NULL)
+    return 0;
+
+  fdmap_t tab;
+  fdmap_init(&tab, -1, -1);
+  fdmap_apply(&tab);
+  reset_signals(&child_mask);
+  external_command(exec->path, exec->argv);
+}
+
+/* Execute internal command within shell's process or execute external command
+ * in a subprocess. External command can be run in the background. Resources
+ * used by a foreground subprocess are stored into usage. */
+static int do_job(cmd_t *cmd, bool bg, struct rusage *usage) {
+  fdmap_t map;
+  int exitcode = 0;
+
+  if (!do_redir(cmd, -1, -1, &map)) {
+    fdmap_close(&map);
+    return EXIT_FAILURE;
+  }
+
+  if (!bg && exec_p(cmd)) {
+    exitcode = exec_shell(cmd, &map);
+    fdmap_close(&map);
+    return exitcode;
+  }
+
+  if (!bg && builtin_p(cmd->argv[0])) {
+    int saved[3];
+    redirect_shell(&map, saved);
+    exitcode = builtin_command(cmd);
+    restore_shell(saved);
+    if (exitcode >= 0) {
+      fdmap_close(&map);
+      return exitcode;
+    }
+  }
+
+  /* Start a subprocess, create a job and monitor it. The subprocess is held
+   * until it has the terminal, see holdchildren. */
+  holdchildren(true);
+  pid_t pid = launch(0, &child_mask, &map, cmd);
+  fdmap_close(&map);
+
   int j = addjob(pid, bg);
-  addproc(j, pid, token);
+  addproc(j, pid, cmd->argv);
 
   if (!bg) {
-    exitcode = monitorjob(&mask);
+    exitcode = exit_status(monitorjob(usage));
+  } else {
+    holdchildren(false);
   }
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
 }
 
-/* Start internal or external command in a subprocess that belongs to pipeline.
- * All subprocesses in pipeline must belong to the same process group. */
-static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens) {
-  ntokens = do_redir(token, ntokens, &input, &output);
+/* Write output of a builtin stage, then tell the shell the stage is finished.
+ * All signals are blocked in the thread, so writing to a pipe that was closed
+ * by the reader fails with EPIPE instead of killing the shell. */
+static void *stage_thread(void *arg) {
+  bstage_t *stage = arg;
 
-  if (ntokens == 0)
-    app_error("ERROR: Command line is not well formed!");
+  /* Output of a stage whose standard output was closed is thrown away. */
+  if (stage->output >= 0) {
+    (void)rio_writen(stage->output, stage->buf, stage->len);
+    Close(stage->output);
+  }
+  free(stage->buf);
 
-  /* Start a subprocess and make sure it's moved to a process group. */
-  pid_t pid = Fork();
+  /* Release: the shell must see the stage finished only after it's written. */
+  atomic_store_explicit(&stage->done, true, memory_order_release);
+  kill(getpid(), SIGCHLD);
+  return NULL;
+}
 
-  if (pid == 0) {
-    Sigprocmask(SIG_SETMASK, mask, NULL);
-    Setpgid(0, pgid);
+/* Run builtin that only prints something within the shell, collecting its
+ * output in memory. The output is written to the pipe by a thread, since the
+ * reader may be slower than the shell. */
+static bstage_t *start_builtin(fdmap_t *map, cmd_t *cmd) {
+  bstage_t *stage = Malloc(sizeof(bstage_t));
+  FILE *f = open_memstream(&stage->buf, &stage->len);
+  int saved[3];
+
+  redirect_shell(map, saved);
+  builtin_out = f;
+  stage->exitcode = builtin_command(cmd);
+  builtin_out = stdout;
+  restore_shell(saved);
+  fclose(f);
+
+  int output = fdmap_get(map, STDOUT_FILENO);
+  stage->output = output < 0 ? -1 : fcntl(output, F_DUPFD_CLOEXEC, 0);
+  atomic_init(&stage->done, false);
+
+  sigset_t all, mask;
+  sigfillset(&all);
+  Sigprocmask(SIG_SETMASK, &all, &mask);
+
+  pthread_t tid;
+  Pthread_create(&tid, NULL, stage_thread, stage);
+  Pthread_detach(tid);
 
-    if (input != -1) {
-      Dup2(input, STDIN_FILENO);
-      Close(input);
-    }
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return stage;
+}
 
-    if (output != -1) {
-      Dup2(output, STDOUT_FILENO);
-      Close(output);
+/* Processes of process substitutions started for the job that's being
+ * created. They're added to the job before processes of its pipeline, which
+ * gives exit code of the job. */
+static struct {
+  pid_t pid;
+  char **argv;
+} *psubproc;
+static int npsubproc, maxpsubproc;
+
+static void start_stages(pipeline_t *pipeline, pid_t *pgidp, int input,
+                         int output, bool in_shell, pid_t *pid,
+                         bstage_t **stage);
+
+/* Start pipelines of process substitutions of a command in process group
+ * *pgidp and connect them to descriptors of the command. */
+static void start_procsubs(pid_t *pgidp, cmd_t *cmd, fdmap_t *map) {
+  for (int i = 0; i < cmd->npsub; i++) {
+    procsub_t *psub = &cmd->psub[i];
+    pipeline_t *pipeline = psub->pipeline;
+    int input = -1, output = -1, end;
+
+    if (psub->mode == T_PSUBIN) {
+      mkpipe(&end, &output, 0);
+    } else {
+      mkpipe(&input, &end, 0);
     }
+    map->opened[map->nopened++] = end;
+    fdmap_set(map, psub->fd, end);
 
-    if (builtin_command(token) >= 0) {
-      exit(EXIT_SUCCESS);
+    pid_t *pid = alloca(sizeof(pid_t) * pipeline->ncmd);
+    bstage_t **stage = alloca(sizeof(bstage_t *) * pipeline->ncmd);
+    start_stages(pipeline, pgidp, input, output, false, pid, stage);
+
+    for (int j = 0; j < pipeline->ncmd; j++) {
+      if (npsubproc == maxpsubproc) {
+        maxpsubproc = maxpsubproc ? maxpsubproc * 2 : 8;
+        psubproc = Realloc(psubproc, sizeof(*psubproc) * maxpsubproc);
+      }
+      psubproc[npsubproc].pid = pid[j];
+      psubproc[npsubproc++].argv = pipeline->cmd[j].argv;
     }
+  }
+
+  fdmap_finish(map);
+}
 
-    external_command(token);
+/* Start internal or external command in a subprocess that belongs to pipeline.
+ * All subprocesses in pipeline must belong to the same process group, which
+ * is created by the first of them if *pgidp is 0. If a builtin that only
+ * prints is run within the shell (when allowed by in_shell), 0 is returned and
+ * the stage is put into stagep. */
+static pid_t do_stage(pid_t *pgidp, sigset_t *mask, int input, int output,
+                      cmd_t *cmd, bool in_shell, bstage_t **stagep) {
+  /* Redirections take precedence over pipes. */
+  fdmap_t map;
+  bool redir_ok = do_redir(cmd, input, output, &map);
+  pid_t pid = 0;
+
+  *stagep = NULL;
+
+  if (redir_ok)
+    start_procsubs(pgidp, cmd, &map);
+
+  pid_t pgid = *pgidp;
+
+  /* Start a subprocess and make sure it's moved to a process group.
+   * Builtins that change state of the shell have to be run in a forked copy
+   * of the shell. If redirection failed the subprocess has to be created
+   * anyway to take its place. */
+  if (redir_ok && !builtin_p(cmd->argv[0])) {
+    pid = launch(pgid, mask, &map, cmd);
+  } else if (redir_ok && in_shell && builtin_pure_p(cmd->argv) &&
+             cmd->npsub == 0) {
+    *stagep = start_builtin(&map, cmd);
+  } else {
+    if ((pid = Fork()) == 0) {
+      if (!redir_ok)
+        exit(EXIT_FAILURE);
+      setup_child(pgid, mask, &map);
+      int rc = builtin_command(cmd);
+      if (rc >= 0)
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+      /* Builtin left the command to the program of the same name,
+       * e.g. 'kill' given a pid instead of a job. */
+      exec_t *exec = prepare_command(cmd);
+      external_command(exec->path, exec->argv);
+    }
+    join_group(pid, pgid);
   }
 
+  fdmap_close(&map);
+  if (*pgidp == 0)
+    *pgidp = pid;
   return pid;
 }
 
-static void mkpipe(int *readp, int *writep) {
+/* Defined by <fcntl.h> only with _GNU_SOURCE, which clashes with csapp.h. */
+#if defined(LINUX) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#endif
+
+/* Largest capacity of a pipe an unprivileged process may request. */
+static int pipe_max_size(void) {
+  static int max_size = 0;
+
+  if (max_size == 0) {
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f == NULL || fscanf(f, "%d", &max_size) != 1)
+      max_size = 1 << 20;
+    if (f)
+      fclose(f);
+  }
+
+  return max_size;
+}
+
+/* Create a pipe. If size is not 0, the capacity of the pipe is changed, so
+ * the writer is not put to sleep every 64KiB with the default one. */
+static void mkpipe(int *readp, int *writep, int size) {
   int fds[2];
   Pipe(fds);
   fcntl(fds[0], F_SETFD, FD_CLOEXEC);
   fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+  if (size > 0) {
+    if (size > pipe_max_size())
+      size = pipe_max_size();
+    /* Fails if user's limit of pipe buffers is exceeded, that's not fatal. */
+    if (fcntl(fds[1], F_SETPIPE_SZ, size) < 0) {
+      debug("pipe size %d: %s\n", size, strerror(errno));
+    }
+  }
+#endif
   *readp = fds[0];
   *writep = fds[1];
 }
 
-/* Pipeline execution creates a multiprocess job. Both internal and external
- * commands are executed in subprocesses. */
-static int do_pipeline(token_t *token, int ntokens, bool bg) {
-  pid_t pid, pgid = 0;
-  int job = -1;
+/* Start stages of a pipeline connected with pipes. The first stage reads from
+ * input and the last one writes to output, unless those are -1; they're
+ * closed once the stages are started. */
+static void start_stages(pipeline_t *pipeline, pid_t *pgidp, int input,
+                         int output, bool in_shell, pid_t *pid,
+                         bstage_t **stage) {
+  int pipesize = pipeline->pipesize ? pipeline->pipesize : opt_pipesize;
+  int last_output = output, next_input = -1;
+
+  for (int i = 0; i < pipeline->ncmd; i++) {
+    cmd_t *cmd = &pipeline->cmd[i];
+
+    output = last_output;
+    if (i < pipeline->ncmd - 1)
+      mkpipe(&next_input, &output, pipesize);
+
+    pid[i] = do_stage(pgidp, &child_mask, input, output, cmd, in_shell,
+                      &stage[i]);
+    MaybeClose(&input);
+    MaybeClose(&output);
+
+    input = next_input;
+    next_input = -1;
+  }
+}
+
+/* Pipeline execution creates a multiprocess job. External commands and
+ * builtins that change state of the shell are executed in subprocesses.
+ * Builtins that only print are run within the shell, unless there's no
+ * subprocess in the pipeline to form a process group. Resources used by
+ * a foreground job are stored into usage. */
+static int do_pipeline(pipeline_t *pipeline, bool bg, struct rusage *usage) {
+  pid_t pgid = 0;
   int exitcode = 0;
 
-  int input = -1, output = -1, next_input = -1;
+  bool in_shell = false;
+  for (int i = 0; i < pipeline->ncmd; i++)
+    if (!builtin_pure_p(pipeline->cmd[i].argv))
+      in_shell = true;
+
+  pid_t *pid = alloca(sizeof(pid_t) * pipeline->ncmd);
+  bstage_t **stage = alloca(sizeof(bstage_t *) * pipeline->ncmd);
+
+  /* Start pipeline subprocesses. The first of them (or of its process
+   * substitutions) becomes the leader of process group. They're held until
+   * the job has the terminal, see holdchildren. */
+  holdchildren(true);
+  npsubproc = 0;
+  start_stages(pipeline, &pgid, -1, -1, in_shell, pid, stage);
+
+  /* Create a job and monitor it. Changes of state of subprocesses that were
+   * reaped in the meantime are applied once the job is looked at. */
+  int job = addjob(pgid, bg);
+  for (int i = 0; i < npsubproc; i++)
+    addproc(job, psubproc[i].pid, psubproc[i].argv);
+  for (int i = 0; i < pipeline->ncmd; i++) {
+    if (stage[i]) {
+      addthread(job, stage[i], pipeline->cmd[i].argv);
+    } else {
+      addproc(job, pid[i], pipeline->cmd[i].argv);
+    }
+  }
 
-  mkpipe(&next_input, &output);
+  if (!bg) {
+    exitcode = exit_status(monitorjob(usage));
+  } else {
+    holdchildren(false);
+  }
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  return exitcode;
+}
 
-  /* Start pipeline subprocesses, create a job and monitor it. */
-  size_t size = 0;  
+/* Report resources used by a pipeline preceded by 'time'. Usage of the shell
+ * itself is added, as builtins may have been run within the shell. */
+static void report_time(struct timespec *start, struct rusage *self,
+                        struct rusage *usage) {
+  struct timespec end, wall;
+  struct rusage now;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &now);
+
+  timersub(&now.ru_utime, &self->ru_utime, &now.ru_utime);
+  timersub(&now.ru_stime, &self->ru_stime, &now.ru_stime);
+  now.ru_maxrss = 0;
+  now.ru_nvcsw -= self->ru_nvcsw;
+  now.ru_nivcsw -= self->ru_nivcsw;
+  rusage_add(usage, &now);
+
+  wall.tv_sec = end.tv_sec - start->tv_sec;
+  wall.tv_nsec = end.tv_nsec - start->tv_nsec;
+  if (wall.tv_nsec < 0) {
+    wall.tv_sec--;
+    wall.tv_nsec += 1000000000;
+  }
+
+  msg("real %ld.%03lds user %ld.%03lds sys %ld.%03lds maxrss %ldKiB "
+      "csw %ld+%ld\n",
+      (long)wall.tv_sec, wall.tv_nsec / 1000000, (long)usage->ru_utime.tv_sec,
+      (long)usage->ru_utime.tv_usec / 1000, (long)usage->ru_stime.tv_sec,
+      (long)usage->ru_stime.tv_usec / 1000, usage->ru_maxrss,
+      usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+/* Words of a list of pipelines, with operators in between, as they're shown
+ * by 'jobs'. Words themselves are not copied. */
+static char **andor_argv(andor_t *andor) {
+  int n = 1;
+  for (int i = 0; i < andor->npipeline; i++) {
+    pipeline_t *pipeline = &andor->pipeline[i];
+    n += 3 + pipeline->ncmd;
+    for (int j = 0; j < pipeline->ncmd; j++)
+      n += pipeline->cmd[j].argc;
+  }
 
-  for (int i = 0; i < ntokens; ++i) {
-    if (token[i] == T_PIPE) {
-      token[i] = T_NULL;
-      size = i;
-      break;
+  char **argv = Malloc(sizeof(char *) * n);
+  int k = 0;
+  for (int i = 0; i < andor->npipeline; i++) {
+    pipeline_t *pipeline = &andor->pipeline[i];
+    if (pipeline->timed)
+      argv[k++] = "time";
+    if (pipeline->negate)
+      argv[k++] = "!";
+    for (int j = 0; j < pipeline->ncmd; j++) {
+      if (j > 0)
+        argv[k++] = "|";
+      for (int a = 0; a < pipeline->cmd[j].argc; a++)
+        argv[k++] = pipeline->cmd[j].argv[a];
     }
+    if (pipeline->next == T_AND)
+      argv[k++] = "&&";
+    else if (pipeline->next == T_OR)
+      argv[k++] = "||";
   }
+  argv[k] = NULL;
+  return argv;
+}
 
-  pgid = do_stage(pgid, &mask, input, output, token, size);
-  MaybeClose(&output);
-  job = addjob(pgid, bg);
-  addproc(job, pgid, token);
+/* Set up a subshell, that runs commands without job control, in its own
+ * process group. Must be called in a child just after Fork. */
+static void setup_subshell(void) {
+  join_group(0, 0);
+  interactive = false;
+  forgetjobs();
+  Sigprocmask(SIG_SETMASK, &child_mask, NULL);
+  Signal(SIGINT, SIG_DFL);
+  Signal(SIGTSTP, SIG_DFL);
+  Signal(SIGTTIN, SIG_DFL);
+  Signal(SIGTTOU, SIG_DFL);
+}
 
-  int next_output = -1;
-  for (int i = size + 1; i < ntokens; ++i) {
-    if (token[i] == T_PIPE) {
-      token[i] = T_NULL;
-      assert(i - size -1 > 0);
-      if (next_input > 0) {
-        mkpipe(&input, &next_output);
-        pid = do_stage(pgid, &mask, next_input, next_output, token + size + 1, i - size - 1);
-        MaybeClose(&next_input);
-        MaybeClose(&next_output);
-      } else {
-        mkpipe(&next_input, &output);
-        pid = do_stage(pgid, &mask, input, output, token + size + 1, i - size - 1);
-        MaybeClose(&input);
-        MaybeClose(&output);
-      }
-      addproc(job, pid, token + size + 1);
-      size = i;
+/* Execute pipelines connected with '&&' or '||'. Pipeline after '&&' (or '||')
+ * is run only if the previous one succeeded (or failed). If the list was
+ * terminated by '&', the whole list is run in the background: a single
+ * pipeline as a job, longer lists by a subshell.
+ * Returns exit code of the last pipeline that was run. */
+static int do_andor(andor_t *andor, bool bg) {
+  int exitcode = 0;
+  token_t prev = T_NULL;
+
+  /* Subshell runs the list as a single background job. */
+  if (bg && andor->npipeline > 1) {
+    pid_t pid;
+    if ((pid = Fork()) == 0) {
+      setup_subshell();
+      exit(do_andor(andor, false));
     }
-  }
+    join_group(pid, 0);
 
-  assert(ntokens - size - 1 > 0);
-  if (next_input > 0) {
-    pid = do_stage(pgid, &mask, next_input, next_output, token + size + 1, ntokens - size - 1);
-    Close(next_input);
-  } else {
-    pid = do_stage(pgid, &mask, input, output, token + size + 1, ntokens - size - 1);
-    Close(input);
+    char **argv = andor_argv(andor);
+    int j = addjob(pid, true);
+    addproc(j, pid, argv);
+    free(argv);
+    return 0;
   }
 
-  addproc(job, pid, token + size + 1);
+  for (int i = 0; i < andor->npipeline; i++) {
+    pipeline_t *pipeline = &andor->pipeline[i];
 
-  if (!bg) {
-    monitorjob(&mask);
+    if ((prev == T_AND && exitcode != 0) || (prev == T_OR && exitcode == 0)) {
+      prev = pipeline->next;
+      continue;
+    }
+
+    struct timespec start;
+    struct rusage self, usage;
+    memset(&usage, 0, sizeof(usage));
+    if (pipeline->timed) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      getrusage(RUSAGE_SELF, &self);
+    }
+
+    /* Process substitutions are run like stages of a pipeline. */
+    if (pipeline->ncmd > 1 || pipeline->cmd[0].npsub > 0) {
+      exitcode = do_pipeline(pipeline, bg, &usage);
+    } else {
+      exitcode = do_job(&pipeline->cmd[0], bg, &usage);
+    }
+
+    /* Background jobs are not waited for, so there's nothing to report. */
+    if (pipeline->timed && !bg)
+      report_time(&start, &self, &usage);
+
+    if (pipeline->negate)
+      exitcode = !exitcode;
+
+    prev = pipeline->next;
   }
-  
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
   return exitcode;
 }
 
-static bool is_pipeline(token_t *token, int ntokens) {
-  for (int i = 0; i < ntokens; i++)
-    if (token[i] == T_PIPE)
-      return true;
-  return false;
-}
+/* Memory for syntax tree of currently executed line. */
+static arena_t line_arena;
+
+/* Input of the shell is split into lines and tokens by the lexer. */
+static lexer_t lexer;
+
+/* Execute a list of pipelines separated by ';' or '&', as read by the lexer.
+ * Returns exit code of the last pipeline that was run. */
+static int eval(lexer_t *lx) {
+  int exitcode = 0;
+  list_t *list;
 
-static void eval(char *cmdline) {
-  bool bg = false;
-  int ntokens;
-  token_t *token = tokenize(cmdline, &ntokens);
+  memset(&stats, 0, sizeof(stats));
+  long allocs = heap_allocs;
 
-  if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
-    token[--ntokens] = NULL;
-    bg = true;
+  if (opt_cache) {
+    list = cache_parse(lx);
+  } else {
+    int ntokens;
+    char **glob;
+    token_t *token = tokenize(lx, lx->line, &glob, &ntokens, &line_arena);
+    list = parse(token, glob, ntokens, &line_arena);
   }
 
-  if (ntokens > 0) {
-    if (is_pipeline(token, ntokens)) {
-      do_pipeline(token, ntokens, bg);
-    } else {
-      do_job(token, ntokens, bg);
-    }
+  if (list == NULL) {
+    msg("syntax error\n");
+    exitcode = 2;
+  } else {
+    for (int i = 0; i < list->nandor; i++)
+      exitcode = do_andor(&list->andor[i], list->andor[i].bg);
   }
 
-  free(token);
+  arena_reset(&line_arena);
+
+  if (opt_stats)
+    msg("glob: %ld, execve: %ld, cache hits: %ld, misses: %ld, heap: %ld\n",
+        stats.glob, stats.exec, cache_hits, cache_misses,
+        heap_allocs - allocs);
+
+  return exitcode;
 }
 
 /* set the line to the name of directory, replace name of home directory by '~' */
@@ -317,57 +1036,275 @@ void find_bang (char *line) {
   }
 }
 
-int main(int argc, char *argv[]) {
-  rl_initialize();
+/* Evaluate lines fed to the lexer in non-interactive mode. Lines that are not
+ * complete yet are left in the lexer, unless it's the end of input. Empty
+ * lines and comments are skipped. Returns exit code of the last line that was
+ * evaluated or the one given if there was none. */
+static int eval_lines(bool eof, int exitcode) {
+  int result;
+
+  while (lexer.len > 0 && (result = lexer_scan(&lexer, eof)) != LEX_MORE) {
+    if (result == LEX_ERROR) {
+      msg("syntax error: unterminated quote or parenthesis\n");
+      exitcode = 2;
+    } else if (lexer.nspans > 0) {
+      exitcode = eval(&lexer);
+    }
+    lexer_next(&lexer);
+    watchjobs(FINISHED);
+  }
 
-  /* read history from ~/.history */
-  read_history(NULL);
+  return exitcode;
+}
 
-  sigemptyset(&sigchld_mask);
-  sigaddset(&sigchld_mask, SIGCHLD);
+/* Read commands from a file with buffered reader. Neither readline nor history
+ * is used in non-interactive mode. Lines longer than the buffer are passed to
+ * the lexer in pieces. */
+static int script_loop(int fd) {
+  char buf[MAXLINE];
+  int exitcode = 0;
+  ssize_t n;
+  rio_t rio;
+
+  rio_readinitb(&rio, fd);
+  while ((n = Rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+    lexer_feed(&lexer, buf, n);
+    exitcode = eval_lines(false, exitcode);
+  }
 
-  Setpgid(0, 0);
+  return eval_lines(true, exitcode);
+}
 
-  initjobs();
+/* Interactive loop is driven by events: input from terminal is passed to
+ * readline's callback interface, while SIGCHLD, SIGINT and SIGWINCH are
+ * received through a signalfd. Signals are blocked at the prompt only, when a
+ * command is executed they're handled as in non-interactive mode. */
+
+#define HISTORY_DELAY 1 /* seconds before history is saved to file */
+#define PS2 "> "        /* prompt for continuation of a line */
+
+static bool loop_done = false;
+static char prompt[MAXLINE];
+static sigset_t loop_mask;     /* signals received through signalfd */
+static sigset_t eval_mask;     /* signal mask when a command is executed */
+static int history_timer = -1; /* fires when history should be saved */
+static bool history_dirty = false;
+static pid_t history_pid;      /* shell that owns the history */
+
+/* Save history to ~/.history, at most once in a while, as the whole file is
+ * rewritten every time. Subprocesses forked by the shell inherit the handler,
+ * but they must not overwrite the file with their copy of history. */
+static void save_history(void) {
+  if (getpid() != history_pid)
+    return;
+  if (history_dirty)
+    write_history(NULL);
+  history_dirty = false;
+}
 
-  Signal(SIGINT, sigint_handler);
-  Signal(SIGTSTP, SIG_IGN);
-  Signal(SIGTTIN, SIG_IGN);
-  Signal(SIGTTOU, SIG_IGN);
+static void schedule_history(void) {
+  struct itimerspec its = {.it_value = {.tv_sec = HISTORY_DELAY}};
+  history_dirty = true;
+  timerfd_settime(history_timer, 0, &its, NULL);
+}
 
-  char *line;
-  char buf[MAXLINE];
+static void line_handler(char *line);
 
-  while (true) {
-    if (!sigsetjmp(loop_env, 1)) {
-      /* set the prompt to the current working directory name */
-      set_line(buf);
-      /* get line from user */
-      line = readline(buf);
-    } else {
-      msg("\n");
-      continue;
-    }
+static void install_prompt(void) {
+  /* set the prompt to the current working directory name */
+  set_line(prompt);
+  rl_callback_handler_install(prompt, line_handler);
+}
+
+/* Prompt shown while the line is read: different one if it's continued. */
+static const char *current_prompt(void) {
+  return lexer.len > 0 ? PS2 : prompt;
+}
+
+/* Called by readline with a complete line. Terminal is given back to normal
+ * mode while the line is executed. */
+static void line_handler(char *line) {
+  rl_callback_handler_remove();
 
-    if (line == NULL)
-      break;
+  if (line == NULL) {
+    loop_done = true;
+    return;
+  }
 
-    if (strlen(line)) {
-      /* check if bang exist in command */
-      find_bang(line); 
-      add_history(line);
-      eval(line);
+  /* check if bang exist in command */
+  find_bang(line);
+  lexer_feed(&lexer, line, strlen(line));
+  lexer_feed(&lexer, "\n", 1);
+  free(line);
+
+  /* wait for the rest of a line continued with quotes or backslash */
+  if (lexer_scan(&lexer, false) == LEX_MORE) {
+    rl_callback_handler_install(PS2, line_handler);
+    return;
+  }
+
+  if (lexer.nspans > 0) {
+    add_history(lexer.line);
+    schedule_history();
+
+    Sigprocmask(SIG_SETMASK, &eval_mask, NULL);
+    eval(&lexer);
+    Sigprocmask(SIG_BLOCK, &loop_mask, NULL);
+  }
+
+  lexer_next(&lexer);
+  reapjobs();
+  watchjobs(FINISHED);
+  install_prompt();
+}
+
+static void handle_signals(int sfd) {
+  struct signalfd_siginfo si;
+
+  while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+    if (si.ssi_signo == SIGCHLD) {
+      /* print notifications above the prompt and the line being edited */
+      if (reapjobs()) {
+        char *text = rl_copy_text(0, rl_end);
+        int point = rl_point;
+
+        rl_set_prompt("");
+        rl_replace_line("", 0);
+        rl_redisplay();
+        fflush(rl_outstream);
+
+        watchjobs(FINISHED);
+
+        rl_set_prompt(current_prompt());
+        rl_replace_line(text, 0);
+        rl_point = point;
+        rl_redisplay();
+        free(text);
+      }
+    } else if (si.ssi_signo == SIGINT) {
+      /* discard the line and start a new one */
+      rl_echo_signal_char(SIGINT);
+      rl_callback_sigcleanup();
+      lexer_reset(&lexer);
+      rl_set_prompt(prompt);
+      rl_replace_line("", 0);
+      rl_crlf();
+      rl_on_new_line();
+      rl_redisplay();
+    } else if (si.ssi_signo == SIGWINCH) {
+      rl_resize_terminal();
     }
+  }
+}
 
-    free(line);
-    watchjobs(FINISHED);
+static void interactive_loop(void) {
+  rl_initialize();
+  rl_catch_signals = 0;
+  rl_catch_sigwinch = 0;
 
-    /* save history to ~/.history */
-    write_history(NULL);
+  /* read history from ~/.history, keep time when commands were entered */
+  history_comment_char = '#';
+  history_write_timestamps = 1;
+  read_history(NULL);
+  history_pid = getpid();
+  atexit(save_history);
+
+  Signal(SIGINT, sigint_handler);
+
+  sigemptyset(&loop_mask);
+  sigaddset(&loop_mask, SIGCHLD);
+  sigaddset(&loop_mask, SIGINT);
+  sigaddset(&loop_mask, SIGWINCH);
+  Sigprocmask(SIG_BLOCK, &loop_mask, &eval_mask);
+
+  int sfd = signalfd(-1, &loop_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  history_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sfd < 0 || history_timer < 0 || epfd < 0)
+    unix_error("Event loop error");
+
+  int fds[] = {STDIN_FILENO, sfd, history_timer};
+  for (int i = 0; i < 3; i++) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+      unix_error("Event loop error");
+  }
+
+  install_prompt();
+
+  while (!loop_done) {
+    struct epoll_event ev[3];
+    int n = epoll_wait(epfd, ev, 3, -1);
+    if (n < 0 && errno != EINTR)
+      unix_error("Event loop error");
+
+    for (int i = 0; i < n && !loop_done; i++) {
+      int fd = ev[i].data.fd;
+      if (fd == STDIN_FILENO) {
+        rl_callback_read_char();
+      } else if (fd == sfd) {
+        handle_signals(sfd);
+      } else if (fd == history_timer) {
+        uint64_t expirations;
+        (void)read(history_timer, &expirations, sizeof(expirations));
+        save_history();
+      }
+    }
   }
 
+  save_history();
+  Close(epfd);
+  Close(history_timer);
+  Close(sfd);
+  Sigprocmask(SIG_SETMASK, &eval_mask, NULL);
+
   msg("\n");
+}
+
+/*
+ * 'shell' - interactive mode if standard input is a terminal
+ * 'shell file' - execute commands from file
+ * 'shell -c command' - execute command
+ */
+int main(int argc, char *argv[]) {
+  char *command = NULL;
+  int fd = STDIN_FILENO;
+  int exitcode = 0;
+
+  if (argc > 2 && !strcmp(argv[1], "-c")) {
+    command = argv[2];
+  } else if (argc > 1) {
+    fd = Open(argv[1], O_RDONLY | O_CLOEXEC, 0);
+  }
+
+  interactive = !command && fd == STDIN_FILENO && isatty(fd);
+
+  builtin_out = stdout;
+
+  sigemptyset(&sigchld_mask);
+  sigaddset(&sigchld_mask, SIGCHLD);
+  Sigprocmask(SIG_BLOCK, NULL, &child_mask);
+
+  if (interactive) {
+    Setpgid(0, 0);
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+    Signal(SIGTTOU, SIG_IGN);
+  }
+
+  initjobs(interactive);
+  lexer_init(&lexer);
+
+  if (interactive) {
+    interactive_loop();
+  } else if (command) {
+    lexer_feed(&lexer, command, strlen(command));
+    exitcode = eval_lines(true, exitcode);
+  } else {
+    exitcode = script_loop(fd);
+  }
+
   shutdownjobs();
 
-  return 0;
+  return exitcode;
 }
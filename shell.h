@@ -2,9 +2,17 @@
 #define _SHELL_H_
 
 #include "csapp.h"
+#include <glob.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
 
 #define msg(...) dprintf(STDERR_FILENO, __VA_ARGS__)
 
+/* Builtins print their results to builtin_out, which is standard output unless
+ * the builtin is run as a stage of a pipeline. */
+extern FILE *builtin_out;
+#define out(...) fprintf(builtin_out, __VA_ARGS__)
+
 #if DEBUG > 0
 #define debug(...) dprintf(STDERR_FILENO, __VA_ARGS__)
 #else
@@ -23,11 +31,146 @@ typedef char *token_t;
 #define T_INPUT ((token_t)7)
 #define T_APPEND ((token_t)8)
 #define T_BANG ((token_t)9)
+#define T_DUPIN ((token_t)10)
+#define T_DUPOUT ((token_t)11)
+#define T_OUTERR ((token_t)12)
+#define T_APPENDERR ((token_t)13)
+#define T_IONUMBER ((token_t)14)
+#define T_HEREDOC ((token_t)15)
+#define T_HERESTR ((token_t)16)
+#define T_PSUBIN ((token_t)17)
+#define T_PSUBOUT ((token_t)18)
 #define separator_p(t) ((t) <= T_COLON)
-#define string_p(t) ((t) > T_BANG)
+#define string_p(t) ((t) > T_PSUBOUT)
+
+/* Token found by the lexer: a span of the line it was read from. */
+typedef struct {
+  int offset; /* start of token in the line */
+  int length; /* length of token in the line */
+  int flags;  /* operator token or TF_WORD with TF_QUOTED or TF_VERBATIM */
+} span_t;
+
+#define TF_OP 0x1f       /* mask of operator token: T_AND ... T_PSUBOUT */
+#define TF_WORD 0x20     /* token is a word */
+#define TF_QUOTED 0x40   /* word has quotes or backslashes to be removed */
+#define TF_VERBATIM 0x80 /* word is taken as is: body of here-document or
+                            command of process substitution */
+
+/* Lexer reads a line incrementally. Input may be fed in pieces of any size,
+ * so long lines and lines continued with quotes or backslash are read in
+ * a single pass. */
+typedef struct {
+  char *line;   /* input, terminated with NUL */
+  int len;      /* length of input */
+  int size;     /* size of buffer */
+  int pos;      /* position the lexer stopped at */
+  int eol;      /* end of line that was read */
+  int state;    /* state the lexer stopped in */
+  int start;    /* start of the word being read */
+  int flags;    /* flags of the word being read */
+  int heredocs; /* number of here-document operators in the line */
+  int heredoc;  /* span of delimiter of here-document being read */
+  span_t *span; /* tokens of the line */
+  int nspans;   /* number of tokens */
+  int maxspans; /* size of span vector */
+} lexer_t;
+
+enum {
+  LEX_MORE,  /* input ended before the end of line */
+  LEX_LINE,  /* line was read */
+  LEX_ERROR, /* input ended in quotes or parentheses */
+};
 
 void strapp(char **dstp, const char *src);
-token_t *tokenize(char *s, int *tokc_p);
+void lexer_init(lexer_t *lx);
+void lexer_feed(lexer_t *lx, const char *text, size_t len);
+int lexer_scan(lexer_t *lx, bool eof);
+void lexer_next(lexer_t *lx);
+void lexer_reset(lexer_t *lx);
+void lexer_destroy(lexer_t *lx);
+token_t *tokenize(lexer_t *lx, char *line, char ***globp, int *tokc_p,
+                  arena_t *arena);
+
+/* Redirections apply to descriptors 0 ... FD_USER - 1. */
+#define FD_USER 10
+
+/* Process substitutions are given descriptors FD_PSUB - 1 and below, as in
+ * bash, so they don't replace descriptors set up by the user. */
+#define FD_PSUB 64
+
+/* Syntax tree of a command line. All nodes are allocated from an arena and
+ * are not modified when the tree is executed. */
+typedef struct {
+  token_t mode; /* T_INPUT, T_OUTPUT, T_APPEND, T_OUTERR or T_APPENDERR for
+                   files, T_DUPIN or T_DUPOUT for descriptors, T_HEREDOC
+                   or T_HERESTR for text given in place */
+  int fd;       /* descriptor that is redirected */
+  char *path;   /* file name, descriptor to copy ("-" to close) or text */
+  char *glob;   /* pattern to expand the file name with or NULL */
+} redir_t;
+
+/* Command looked up in $PATH with its arguments expanded. It's kept next to
+ * the syntax tree, so it can be reused when a cached line is run again. */
+typedef struct {
+  arena_t *arena;   /* memory for path & argv */
+  bool done;        /* command has been looked up and expanded */
+  const char *path; /* path to execute or NULL if command was not found */
+  char **argv;      /* arguments with wildcards expanded */
+  int gen;          /* generation of hash table or -1 if not looked up */
+  int dir;          /* index of directory in $PATH, see hash_lookup */
+  bool cwd_glob;    /* wildcards were matched in current directory */
+  bool any_glob;    /* wildcards were matched in other directories */
+  dev_t cwd_dev;    /* identity and modification time of current directory */
+  ino_t cwd_ino;    /* at the time wildcards were expanded */
+  struct timespec cwd_mtime;
+} exec_t;
+
+typedef struct {
+  char **argv;          /* NULL-terminated vector of words */
+  char **glob;          /* for every word: pattern to expand it with or NULL */
+  int argc;             /* number of words */
+  redir_t *redir;       /* redirections in order of appearance */
+  int nredir;           /* number of redirections */
+  exec_t *exec;         /* filled in when command is executed */
+  struct procsub *psub; /* process substitutions among the words */
+  int npsub;            /* number of process substitutions */
+} cmd_t;
+
+typedef struct pipeline {
+  cmd_t *cmd;   /* commands connected with pipes */
+  int ncmd;     /* number of commands */
+  bool timed;   /* preceded by 'time', resource usage is reported */
+  bool negate;  /* preceded by '!', exit code is negated */
+  int pipesize; /* capacity of pipes given by PIPESIZE= or 0 */
+  token_t next; /* T_AND or T_OR if followed by another pipeline */
+} pipeline_t;
+
+/* Process substitution: a pipeline that's run together with the command and
+ * connected with a pipe to one of its descriptors, which is given to the
+ * command as /dev/fd/N in place of the word. */
+typedef struct procsub {
+  token_t mode;         /* T_PSUBIN for <(...), T_PSUBOUT for >(...) */
+  int fd;               /* descriptor of the command, N of /dev/fd/N */
+  pipeline_t *pipeline; /* command that writes to or reads from it */
+} procsub_t;
+
+typedef struct {
+  pipeline_t *pipeline; /* pipelines connected with '&&' or '||' */
+  int npipeline;        /* number of pipelines */
+  bool bg;              /* terminated by '&' */
+} andor_t;
+
+typedef struct {
+  andor_t *andor; /* lists separated by ';' or '&' */
+  int nandor;     /* number of lists */
+} list_t;
+
+list_t *parse(token_t *token, char **glob, int ntokens, arena_t *arena);
+bool parse_size(const char *str, int *sizep);
+list_t *cache_parse(lexer_t *lx);
+
+extern long cache_hits;
+extern long cache_misses;
 
 /* Do not change those values or code will break! */
 enum {
@@ -43,20 +186,66 @@ enum {
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
 };
 
-void initjobs(void);
+/* Builtin run as a stage of a pipeline by a thread of the shell. The builtin
+ * itself is run by the main thread, the thread only writes its output. */
+typedef struct {
+  int output;       /* descriptor the output is written to */
+  char *buf;        /* output of the builtin */
+  size_t len;       /* length of output */
+  int exitcode;     /* exit code of the builtin */
+  atomic_bool done; /* set by the thread when it's finished */
+} bstage_t;
+
+void initjobs(bool interactive);
 void shutdownjobs(void);
+void forgetjobs(void);
 
 int addjob(pid_t pgid, int bg);
 void addproc(int job, pid_t pid, char **argv);
+void addthread(int job, bstage_t *stage, char **argv);
 bool killjob(int job);
 void watchjobs(int state);
+bool reapjobs(void);
+void listjobs(bool verbose);
 int jobstate(int job, int *exitcodep);
 char *jobcmd(int job);
-bool resumejob(int job, int bg, sigset_t *mask);
-int monitorjob(sigset_t *mask);
+bool resumejob(int job, int bg);
+int monitorjob(struct rusage *usage);
+void holdchildren(bool hold);
+void rusage_add(struct rusage *sum, const struct rusage *ru);
+
+bool builtin_p(const char *name);
+bool builtin_pure_p(char **argv);
+int builtin_command(cmd_t *cmd);
+exec_t *prepare_command(cmd_t *cmd);
+bool prepared_valid(exec_t *exec);
+const char *resolve_command(const char *name);
+noreturn void external_command(const char *path, char **argv);
+
+#define HASH_ANY -1      /* command was not found in any directory */
+#define HASH_UNCACHED -2 /* result depends on current directory */
+
+const char *hash_lookup(const char *name, int *dirp);
+int hash_generation(void);
+bool hash_valid(int gen, int dir);
+void hash_insert(const char *name, const char *path);
+void hash_reset(void);
+void hash_list(void);
+
+/* Shell options, see 'set' builtin. */
+extern int opt_spawn; /* launch external commands with posix_spawn */
+extern int opt_stats; /* report stats after each command line */
+extern int opt_cache; /* reuse parsed command lines */
+extern int opt_pipesize; /* capacity of pipes created for pipelines or 0 */
+extern int opt_pidfd; /* monitor foreground jobs with pidfds if possible */
+
+/* Counters of costly operations performed for a command line. */
+typedef struct {
+  long glob; /* calls to glob */
+  long exec; /* calls to execve or posix_spawn */
+} stats_t;
 
-int builtin_command(char **argv);
-noreturn void external_command(char **argv);
+extern stats_t stats;
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
 extern sigset_t sigchld_mask;
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Builtins that only print are run within the shell when they're stages of
+# a pipeline, and their output is written to the pipe by a thread. A stage
+# whose standard output is closed has nowhere to write, which must not take
+# the shell down.
+
+shell=${1:-./shell}
+
+out=$($shell -c 'set | wc -l; jobs >&- | cat;
+                 history >&- | cat; set >&- | cat; echo alive' 2>&1)
+lines=$(echo "$out" | head -1)
+last=$(echo "$out" | tail -1)
+
+echo "builtin-stage: 'set | wc -l' gave $lines, last line '$last'"
+if [ "$lines" -lt 1 ] || [ "$last" != alive ]; then
+  echo "$out"
+  exit 1
+fi
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Here-documents are written into a pipe, which is resized for bodies over
+# 64KiB, or into a sealed memfd for bodies over 1MiB. A body of each size is
+# read back by cksum and compared with the checksum of the text itself.
+
+shell=$(realpath ${1:-./shell})
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+cd $dir
+
+# Print a body of about $1 bytes: numbered lines with blanks, quotes and $.
+body() {
+  seq -f "line %g	'\$x' \"a  b\" \\" $(($1 / 24))
+}
+
+for size in 1000 100000 3000000; do
+  body $size > body
+  { echo 'cksum <<EOF'; cat body; echo EOF; echo 'wc -c <<< word'; } > script
+  expected="$(cksum < body)
+5"
+  out=$($shell script 2>&1)
+  if [ "$out" != "$expected" ]; then
+    echo "heredoc: body of $(wc -c < body) bytes read back wrong"
+    echo "$out"
+    exit 1
+  fi
+  echo "heredoc: body of $(wc -c < body) bytes read back"
+done
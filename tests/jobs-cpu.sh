@@ -0,0 +1,35 @@
+#!/bin/bash
+# CPU time that 'jobs -l' reports for a live process must be the sum of utime
+# and stime from /proc/<pid>/stat. The process is stopped while it's compared,
+# so the times don't change in the meantime. dd copying a byte at a time spends
+# most of its time in the kernel, so stime is not zero.
+
+shell=${1:-./shell}
+dir=$(mktemp -d)
+trap 'kill -9 $pid 2>/dev/null; exec 3>&-; rm -rf $dir' EXIT
+
+mkfifo $dir/in
+$shell < $dir/in > $dir/out 2> $dir/err &
+exec 3> $dir/in
+
+echo 'dd if=/dev/zero of=/dev/null bs=1 count=1000000000 &' >&3
+sleep 1
+pid=$(sed -n 's/^\[1\] \([0-9]*\)$/\1/p' $dir/err)
+if [ -z "$pid" ]; then
+  echo "jobs-cpu: background job was not started"
+  exit 1
+fi
+kill -STOP $pid
+sleep 0.2
+
+read -r utime stime < <(sed 's/.*) //' /proc/$pid/stat | cut -d' ' -f12,13)
+echo 'jobs -l' >&3
+sleep 0.3
+
+cpu=$(sed -n "s/^ *$pid .*, cpu \([0-9.]*\)s .*/\1/p" $dir/out)
+ticks=$(( (utime + stime) * 100 / $(getconf CLK_TCK) ))
+expected=$(printf '%d.%02d' $((ticks / 100)) $((ticks % 100)))
+echo "jobs-cpu: utime $utime stime $stime ticks, cpu ${cpu}s, expected ${expected}s"
+if [ "$stime" -eq 0 ] || [ "$cpu" != "$expected" ]; then
+  exit 1
+fi
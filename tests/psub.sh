@@ -0,0 +1,38 @@
+#!/bin/bash
+# Process substitution: pipelines in <(...) and >(...) are connected to the
+# command with pipes given as /dev/fd/N, N counting down from 63. Processes of
+# the substitutions are part of the command's job, so the output of >(...) is
+# complete when the command is done.
+
+shell=$(realpath ${1:-./shell})
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+cd $dir
+
+cat > script <<'SCRIPT'
+diff <(printf 'a\nb\n') <(printf 'a\nc\n')
+cmp <(seq 100000) <(seq 100000 | cat) && echo same
+seq 1000 | tee >(wc -l > count) > /dev/null
+cat count
+wc -l <(seq 5) <(seq 7 | head -6)
+SCRIPT
+
+cat > expected <<'EXPECTED'
+2c2
+< b
+---
+> c
+same
+1000
+5 /dev/fd/63
+6 /dev/fd/62
+11 total
+EXPECTED
+
+# Counts are aligned by wc.
+$shell script 2>&1 | sed 's/^ *//' > out
+if ! diff -u expected out; then
+  echo "psub: output differs"
+  exit 1
+fi
+echo "psub: $(wc -l < out) lines as expected"
@@ -0,0 +1,47 @@
+#!/bin/bash
+# Quoting and line continuation: a script is run by the shell from a file and
+# its output compared with what's expected. Quoted words and words with escaped
+# wildcards aren't expanded, by commands nor by 'cd'. A backslash at the end of
+# a line and an unclosed quote continue the line.
+
+shell=$(realpath ${1:-./shell})
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+mkdir $dir/'a*' $dir/abc $dir/abd $dir/xyz
+cd $dir
+
+cat > script <<'SCRIPT'
+echo a\
+b "c  d" 'e $f' g\ h "x\"y" '\n' a""b c''d
+echo "multi
+line" ca\
+t
+echo abc | \
+tr a-c A-C
+echo x*
+echo "x*" 'x*' x\*
+cd "a*"
+pwd
+cd ..
+cd 'x'*
+pwd
+SCRIPT
+
+cat > expected <<EXPECTED
+ab c  d e \$f g h x"y \\n ab cd
+multi
+line cat
+ABC
+xyz
+x* x* x*
+$dir/a*
+$dir/xyz
+EXPECTED
+
+$shell script > out 2>&1
+if ! diff -u expected out; then
+  echo "quoting: output differs"
+  exit 1
+fi
+echo "quoting: $(wc -l < out) lines as expected"
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Redirections to descriptors: 'n>&m' copies a descriptor, 'n>&-' closes it,
+# and 'exec' keeps descriptors opened by the shell for later commands, until
+# they're closed again. Output of a script run by the shell from a file is
+# compared with what's expected; a copy of a closed descriptor is an error.
+
+shell=$(realpath ${1:-./shell})
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+cd $dir
+
+cat > script <<'SCRIPT'
+echo one 3>f1 >&3
+cat f1
+ls /nonexistent 2>&1 >/dev/null | wc -l
+ls /nonexistent 2>&-
+exec 3>f2
+echo two >&3
+echo three >&3
+exec 3>&-
+echo four >&3
+echo five 1>&-
+cat f2
+exec 4<f2
+cat <&4
+exec 4<&-
+cat <&4
+echo done
+SCRIPT
+
+cat > expected <<'EXPECTED'
+one
+1
+two
+three
+two
+three
+done
+EXPECTED
+
+$shell script > out 2> err
+if ! diff -u expected out; then
+  echo "redirect: output differs"
+  exit 1
+fi
+if [ $(grep -c 'bad file descriptor' err) != 2 ]; then
+  echo "redirect: copies of closed descriptors weren't reported"
+  cat err
+  exit 1
+fi
+echo "redirect: $(wc -l < out) lines as expected, $(wc -l < err) errors"